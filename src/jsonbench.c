@@ -0,0 +1,358 @@
+/** \file jsonbench.c */
+
+/** This program measures the speed of jstream: after compiling
+    it by `clang -O2 jsonbench.c jstream.c -o jsonbench -lm`, use
+    it as
+
+        jsonbench [-s MB] [-r runs] [-i] [-z] [-k] [-x n] [-p n] [file...]
+
+    to parse, dump and walk each of the files, or if none is given
+    a synthetic corpus generated in memory, with texts of about
+    16 MB (or the given number of MB) each: deep nesting, a large
+    numeric array, long strings, many small objects and NDJSON
+    records. Each text is parsed by jstream (reading from memory
+    by p.read) and by jstream_parse_buffer, followed by
+    jstream_next_document if it contains more values (e.g.
+    NDJSON), each stored into the same block (p.reuse); then the
+    values, parsed again one after the other into a single block
+    (p.append), are dumped by jstream_dump (to the null device)
+    and walked item by item by jstream_skip. For each measure
+    the best of the given number of runs (default 5) is
+    printed, in MB/s of the text and values (docs) per second,
+    with the number of allocations made while parsing, the
+    capacity of the block at the end and the peak of the bytes
+    allocated by the parser at the same time (both counted by its
+    allocation hooks, so that each text and option shows its own
+    figures); the peak resident memory of the whole process is
+    printed once at the end. The options set
+    the fields of struct jstream_param_s used to parse: -i
+    integers, -z refs, -k intern, -x n index and -p n packed, so
+    that the effect of each of them can be measured. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "jstream.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define NULL_DEVICE "/dev/null"
+#else
+#define NULL_DEVICE "NUL"
+#endif
+
+/** A text to parse. */
+struct text_s {
+    const char *name;
+    char *s;
+    size_t n;
+};
+
+/** Return a text of about n characters made by the generator g,
+    which appends to s the k-th chunk and returns its length. */
+static char *generate(size_t n, size_t *len, const char *open,
+    size_t (*g)(char *s, unsigned k), const char *sep, const char *close)
+{
+    char *s = malloc(n + 65536);
+    if (s == NULL) return NULL;
+    size_t i = strlen(open);
+    memcpy(s, open, i);
+    for (unsigned k = 0; i < n; ++ k) {
+        if (k > 0) i += strlen(strcpy(s + i, sep));
+        i += g(s + i, k);
+    }
+    i += strlen(strcpy(s + i, close));
+    *len = i;
+    return s;
+}
+
+/** An array nested 500 levels deep, alternating with objects. */
+static size_t deep(char *s, unsigned k)
+{
+    size_t i = 0;
+    for (int d = 0; d < 500; ++ d) {
+        if (d % 2) i += sprintf(s + i, "{\"k%d\":", d % 7);
+        else i += sprintf(s + i, "[%u,", k);
+    }
+    s[i ++] = '0';
+    for (int d = 499; d >= 0; -- d) s[i ++] = d % 2 ? '}' : ']';
+    return i;
+}
+
+/** A number, integer or not. */
+static size_t number(char *s, unsigned k)
+{
+    return k % 3 ? sprintf(s, "%u", k * 7919u % 1000003u)
+        : sprintf(s, "%.6g", (k % 2000) * 0.03125 - 31.5);
+}
+
+/** A string of 1 to 4 KB, with an escape every 64 characters. */
+static size_t string(char *s, unsigned k)
+{
+    size_t n = 1024 + k * 2654435761u % 3072, i = 0;
+    s[i ++] = '"';
+    for (size_t j = 0; j < n; ++ j) {
+        if (j % 64 == 63) {
+            s[i ++] = '\\';
+            s[i ++] = "n\"\\t"[j / 64 % 4];
+        } else {
+            s[i ++] = 'a' + (j + k) % 26;
+        }
+    }
+    s[i ++] = '"';
+    return i;
+}
+
+/** A small object, as a record of NDJSON. */
+static size_t record(char *s, unsigned k)
+{
+    return sprintf(s, "{\"id\":%u,\"name\":\"user%u\",\"score\":%u.%02u,"
+        "\"tags\":[\"a\",\"b\"],\"ok\":%s,\"ref\":null}", k, k * 7919u,
+        k % 1000, k % 100, k & 1 ? "true" : "false");
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/** Peak resident memory of the process, in KB (0 if unknown). */
+static long peak_rss(void)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage u;
+    if (getrusage(RUSAGE_SELF, &u) != 0) return 0;
+#ifdef __APPLE__
+    return u.ru_maxrss / 1024;
+#else
+    return u.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/** Memory used by a parser, counted by its allocation hooks. */
+struct count_s {
+    size_t allocs;      ///< blocks allocated and resized
+    size_t bytes;       ///< bytes allocated now
+    size_t peak;        ///< maximum of bytes
+};
+
+/** Bytes before each block counted by the hooks, holding its size
+    (16, to keep the alignment of malloc). */
+#define COUNT_HEADER 16
+
+/** Allocation hooks counting the blocks allocated and resized and
+    the bytes they take. */
+static void *count_realloc(void *user, void *ptr, size_t size)
+{
+    struct count_s *c = user;
+    char *b = ptr == NULL ? NULL : (char*) ptr - COUNT_HEADER;
+    size_t old = b == NULL ? 0 : *(size_t*) b;
+    b = realloc(b, size + COUNT_HEADER);
+    if (b == NULL) return NULL;
+    *(size_t*) b = size;
+    ++ c->allocs;
+    c->bytes += size - old;
+    if (c->bytes > c->peak) c->peak = c->bytes;
+    return b + COUNT_HEADER;
+}
+
+static void *count_alloc(void *user, size_t size)
+{
+    return count_realloc(user, NULL, size);
+}
+
+static void count_free(void *user, void *ptr)
+{
+    struct count_s *c = user;
+    if (ptr == NULL) return;
+    char *b = (char*) ptr - COUNT_HEADER;
+    c->bytes -= *(size_t*) b;
+    free(b);
+}
+
+/** Input from memory for jstream. */
+struct input_s {
+    const char *s;
+    size_t n, i;
+};
+
+static size_t read_input(void *ctx, char *buf, size_t cap)
+{
+    struct input_s *in = ctx;
+    size_t n = in->n - in->i < cap ? in->n - in->i : cap;
+    memcpy(buf, in->s + in->i, n);
+    in->i += n;
+    return n;
+}
+
+/** Visit the value v and its items, each one skipped by
+    jstream_skip, returning their number and the address of
+    the value following v into *next. */
+static size_t walk(jstream_t v, jstream_t *next)
+{
+    size_t n = 1;
+    if (v[0] == ARRAY || v[0] == OBJECT) {
+        jstream_t e = v + (v[0] == ARRAY ? 3 : 4);
+        unsigned items = v[0] == ARRAY ? v[1] : 2 * v[1];
+        for (unsigned i = 0; i < items; ++ i) n += walk(e, &e);
+    }
+    *next = jstream_skip(v);
+    return n;
+}
+
+/** Options of the parsing, set by the command line. */
+static struct jstream_param_s options;
+
+/** Number of runs of each measure. */
+static int runs = 5;
+
+/** Print a measure: dt seconds to process n characters in docs
+    values, allocating c->allocs blocks, with a block of capacity
+    words at the end. */
+static void report(const char *text, const char *what, double dt,
+    size_t n, size_t docs, const struct count_s *c, size_t capacity)
+{
+    printf("%-8s %-7s %9.1f MB/s %12.0f docs/s %8zu allocs %9.1f KB block %9.1f KB peak\n",
+        text, what, n / dt / 1e6, docs / dt, c->allocs,
+        capacity * sizeof(unsigned) / 1024.0, c->peak / 1024.0);
+}
+
+/** Parse all the values in the text t by means of p, by jstream
+    if stream is not 0, else by jstream_parse_buffer: return their
+    number, or 0 in case of error. */
+static size_t parse(jstream_param_t p, const struct text_s *t, int stream)
+{
+    struct input_s in = {t->s, t->n, 0};
+    p->read = read_input;
+    p->ctx = &in;
+    if ((stream ? jstream(p) : jstream_parse_buffer(p, t->s, t->n)) == NULL) return 0;
+    size_t k = 1;
+    while (jstream_next_document(p) != NULL) ++ k;
+    return p->error == ERR_END ? k : 0;
+}
+
+/** Run the measures on the text t: return 0 if it can't be
+    parsed. */
+static int bench(const struct text_s *t)
+{
+    // jstream, jstream_parse_buffer, jstream_dump and jstream_skip
+    double best[4] = {1e30, 1e30, 1e30, 1e30};
+    size_t docs = 0, items = 0, capacity[3] = {0};
+    struct count_s counts[3], none = {0};
+    for (int r = 0; r < runs; ++ r) {
+        struct jstream_param_s p;
+        for (int m = 0; m < 3; ++ m) {
+            p = options;
+            p.mem_alloc = count_alloc;
+            p.mem_realloc = count_realloc;
+            p.mem_free = count_free;
+            p.mem_user = counts + m;
+            counts[m] = none;
+            p.reuse = m < 2;
+            p.append = m == 2;  // all the values, to be dumped and skipped
+            double t0 = now();
+            docs = parse(&p, t, m == 0);
+            double dt = now() - t0;
+            if (docs == 0) {
+                printf("%-8s error #%i at offset %zu\n", t->name, p.error, p.offset);
+                jstream_free(&p);
+                return 0;
+            }
+            capacity[m] = p.capacity;
+            if (m < 2) {
+                if (dt < best[m]) best[m] = dt;
+                jstream_free(&p);
+            }
+        }
+        FILE *f = fopen(NULL_DEVICE, "w");
+        double t0 = now();
+        for (jstream_t v = p.obj; f != NULL && v < p.obj + p.size; )
+            v = jstream_dump(f, v);
+        double dt = now() - t0;
+        if (f != NULL) fclose(f);
+        if (dt < best[2]) best[2] = dt;
+        t0 = now();
+        items = 0;
+        for (jstream_t v = p.obj; v < p.obj + p.size; ) items += walk(v, &v);
+        dt = now() - t0;
+        if (dt < best[3]) best[3] = dt;
+        jstream_free(&p);
+    }
+    report(t->name, "jstream", best[0], t->n, docs, counts, capacity[0]);
+    report(t->name, "buffer", best[1], t->n, docs, counts + 1, capacity[1]);
+    // dump and skip allocate nothing, and walk the block of p.append
+    report(t->name, "dump", best[2], t->n, docs, &none, capacity[2]);
+    report(t->name, "skip", best[3], t->n, docs, &none, capacity[2]);
+    printf("%-8s %zu characters, %zu values, %zu items\n\n", t->name, t->n, docs, items);
+    return 1;
+}
+
+int main(int n, char **a)
+{
+    size_t size = 16 << 20;
+    int i = 1;
+    for (; i < n && a[i][0] == '-'; ++ i) {
+        if (strcmp(a[i], "-i") == 0) options.integers = 1;
+        else if (strcmp(a[i], "-z") == 0) options.refs = 1;
+        else if (strcmp(a[i], "-k") == 0) options.intern = 1;
+        else if (i + 1 < n && strcmp(a[i], "-s") == 0) size = (size_t) atoi(a[++ i]) << 20;
+        else if (i + 1 < n && strcmp(a[i], "-r") == 0) runs = atoi(a[++ i]);
+        else if (i + 1 < n && strcmp(a[i], "-x") == 0) options.index = atoi(a[++ i]);
+        else if (i + 1 < n && strcmp(a[i], "-p") == 0) options.packed = atoi(a[++ i]);
+        else {
+            fprintf(stderr, "Unknown option %s\n", a[i]);
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    int ok = 1;
+    if (i < n) {
+        for (; i < n; ++ i) {
+            FILE *f = fopen(a[i], "rb");
+            if (f == NULL) {
+                perror(a[i]);
+                ok = 0;
+                continue;
+            }
+            struct text_s t = {a[i], NULL, 0};
+            if (fseek(f, 0, SEEK_END) == 0 && (long) (t.n = ftell(f)) >= 0
+                && fseek(f, 0, SEEK_SET) == 0 && (t.s = malloc(t.n + 1)) != NULL
+                && fread(t.s, 1, t.n, f) == t.n)
+                ok &= bench(&t);
+            else
+                perror(a[i]);
+            free(t.s);
+            fclose(f);
+        }
+        printf("%ld KB peak RSS of the process\n", peak_rss());
+        return !ok;
+    }
+    struct text_s corpus[] = {
+        {"deep", NULL, 0},
+        {"numbers", NULL, 0},
+        {"strings", NULL, 0},
+        {"objects", NULL, 0},
+        {"ndjson", NULL, 0},
+    };
+    corpus[0].s = generate(size, &corpus[0].n, "[", deep, ",", "]");
+    corpus[1].s = generate(size, &corpus[1].n, "[", number, ",", "]");
+    corpus[2].s = generate(size, &corpus[2].n, "[", string, ",", "]");
+    corpus[3].s = generate(size, &corpus[3].n, "[", record, ",", "]");
+    corpus[4].s = generate(size, &corpus[4].n, "", record, "\n", "\n");
+    for (size_t k = 0; k < sizeof(corpus) / sizeof(corpus[0]); ++ k) {
+        if (corpus[k].s == NULL) {
+            fputs("Out of memory\n", stderr);
+            return 1;
+        }
+        ok &= bench(corpus + k);
+        free(corpus[k].s);
+    }
+    printf("%ld KB peak RSS of the process\n", peak_rss());
+    return !ok;
+}
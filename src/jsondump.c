@@ -6,34 +6,35 @@
         jsondump file1 ... filen
     
     to read, store as objects and dump on the terminal again
-    in compressed Json format the contents of file1 ... filen. */
+    in compressed Json format the contents of file1 ... filen
+    (each of them may contain more Json values, e.g. one per
+    line, which are dumped one per line). */
 
 #include <stdio.h>
 #include "jstream.h"
 
-static FILE *f = NULL;
-
-static int get(void)
+static size_t readf(void *ctx, char *buf, size_t cap)
 {
-    return fgetc(f);
+    return fread(buf, 1, cap, ctx);
 }
 
 int main(int n, char **a)
 {
+    // The same memory block is reused to parse all files
+    struct jstream_param_s param = {0};
+    param.read = readf;
+    param.reuse = 1;
     for (int i = 1; i < n; ++ i ) {
-        if ((f = fopen(a[i], "r")) == NULL) {
+        FILE *f = fopen(a[i], "r");
+        if (f == NULL) {
             perror(a[i]);
             continue;
         }
         printf("\nProcessing file %s:\n", a[i]);
-        struct jstream_param_s param;
-        param.get = get;
+        param.ctx = f;
+        // The file may contain more values, e.g. one per line
         jstream_t obj = jstream(&param);
-        fclose(f);
-        if (param.error) {
-            printf("Error #%i (last char = '%c').\n", param.error,
-                param.clast);
-        } else {
+        while (obj != NULL) {
             if (0) {
                 puts("Binary dump:");
                 for (int i = 0; i < param.size; ++ i)
@@ -42,7 +43,14 @@ int main(int n, char **a)
             }
             jstream_dump(stdout, obj);
             putchar('\n');
+            obj = jstream_next_document(&param);
+        }
+        fclose(f);
+        if (param.error != ERR_NONE && param.error != ERR_END) {
+            printf("Error #%i (last char = '%c').\n", param.error,
+                param.clast);
         }
     }
+    jstream_free(&param);
     return 0;
 }
@@ -0,0 +1,104 @@
+/** \file jsonpar.c */
+
+/** This program shows how to use jstream_parallel: after
+    compiling it by
+    `clang -O2 jsonpar.c jstream_par.c jstream.c -o jsonpar -lpthread`,
+    use it as
+
+        jsonpar [-a] [file [threads]]
+
+    to parse the NDJSON file (one Json value per line) by 1, 2,
+    4... up to the given number of threads (default 8), printing
+    the throughput of each run: if no file is given, a synthetic
+    text of 256 MB is generated in memory and parsed. With -a
+    the file (or the synthetic text) contains a single array,
+    parsed by jstream_parallel_array. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "jstream_par.h"
+
+/** Record function: count the words of the records. */
+static int count(void *ctx, jstream_t obj, size_t offset)
+{
+    (void) offset;
+    *(size_t*)ctx += jstream_skip(obj) - obj;
+    return 0;
+}
+
+/** Return a synthetic NDJSON text of about n characters, or an
+    array if array is not 0. */
+static char *generate(size_t n, size_t *len, int array)
+{
+    char *s = malloc(n + 256);
+    size_t i = 0;
+    if (s != NULL && array) s[i ++] = '[';
+    for (unsigned r = 0; s != NULL && i < n; ++ r) {
+        if (array && r > 0) s[i ++] = ',';
+        i += sprintf(s + i, "{\"id\": %u, \"name\": \"user%u\", \"score\": %u.%02u, "
+            "\"tags\": [\"a\", \"b\", %s], \"ok\": %s}\n", r, r * 7919u,
+            r % 1000, r % 100, r & 1 ? "null" : "\"c\"", r & 2 ? "true" : "false");
+    }
+    if (s != NULL && array) s[i ++] = ']';
+    *len = i;
+    return s;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int n, char **a)
+{
+    int array = n > 1 && strcmp(a[1], "-a") == 0;
+    if (array) {
+        -- n;
+        ++ a;
+    }
+    size_t len = 0;
+    char *s = n > 1 ? NULL : generate(256 << 20, &len, array);
+    unsigned threads = n > 2 ? atoi(a[2]) : 8;
+    for (int ordered = 1; ordered >= 0; -- ordered) {
+        printf("%s output:\n", ordered ? "Ordered" : "Unordered");
+        for (unsigned t = 1; t <= threads; t *= 2) {
+            size_t words = 0;
+            struct jstream_parallel_s q = {0};
+            q.threads = t;
+            q.ordered = ordered;
+            q.record = count;
+            q.ctx = &words;
+            double t0 = now();
+            int e;
+            if (array) {
+                // without q.record the array would be stitched
+                if (n > 1) jstream_parallel_array_file(&q, a[1]);
+                else jstream_parallel_array(&q, s, len);
+                e = q.error;
+            } else {
+                e = n > 1 ? jstream_parallel_file(&q, a[1])
+                    : jstream_parallel(&q, s, len);
+            }
+            double dt = now() - t0;
+            if (e != ERR_NONE) {
+                printf("Error #%i at offset %zu.\n", e, q.offset);
+                break;
+            }
+            if (n > 1 && len == 0) {
+                FILE *f = fopen(a[1], "rb");
+                fseek(f, 0, SEEK_END);
+                len = ftell(f);
+                fclose(f);
+            }
+            printf("%3u threads: %zu records (%zu words) in %.3f s, "
+                "%.1f MB/s, %.0f records/s\n", t, q.records, words, dt,
+                len / dt / (1 << 20), q.records / dt);
+        }
+    }
+    free(s);
+    return 0;
+}
@@ -15,28 +15,61 @@
         - 4 = string
         - 5 = array
         - 6 = object
+        - 7 = integer
+        - 8 = string reference
+        - 9 = symbol
+        - 10 = array of doubles
+        - 11 = array of integers
 
     After that it follows:
         - If code == 0 or == 1 or == 2, nothing.
         - if code == 3, a double.
-        - if code == 4, a C-string.
+        - if code == 4, an unsigned n (the length of the string)
+            followed by a C-string of n characters.
         - If code == 5, an unsigned n (the number of elements)
-            followed by n values.
-        - If code == 6, an unsigned n (the number of elements)
-            followed by n pairs of values.
+            and an unsigned w (the number of words taken by the
+            whole array, code included) followed by n values.
+        - If code == 6, an unsigned n (the number of elements),
+            an unsigned w (the number of words taken by the
+            whole object, code included) and an unsigned h
+            followed by n pairs of values: if h is not 0, then
+            a hash table of the keys follows them, h words after
+            the code (see jstream_get).
+        - if code == 7, an int64_t.
+        - if code == 8, an unsigned n (the length of the string)
+            followed by the address of its n characters inside
+            the parsed buffer (which are not followed by a '\0').
+        - if code == 9, an unsigned n (the length of the string)
+            and an unsigned b: the string is the same as the one
+            b words before the code (a repeated key, interned).
+        - If code == 10 or 11, an unsigned n (the number of
+            elements), an unsigned w (the number of words taken
+            by the whole array, code included) and an unsigned d
+            followed by n doubles or int64_t's, d words after the
+            code, aligned to 8 bytes from the start of the block.
+
+    Numbers are always stored as doubles, unless integers are
+    asked for when parsing: then numbers without fraction and
+    exponent that fit an int64_t are stored as such.
     
     When parsing a stream, the string representing the value
-    contained in the Json grows to host new data. If an
-    allocation error occurs, all is freed and an error code
-    is returned.
+    contained in the Json grows to host new data: its capacity
+    is doubled each time it is exhausted, so that the parsing
+    takes amortized linear time, and it is trimmed to the used
+    size once the parsing is over (unless the caller asks not
+    to). Memory is taken from malloc/realloc/free unless the
+    caller provides its own allocation hooks. If an allocation
+    error occurs, all is freed and an error code is returned.
 
     \section json_grammar Grammar accepted
 
     JSON Grammar accepted by the parser (borrowed from
     <https://www.json.org/>.
 
-    \warning This version assumes that streams
-        emit ASCII and not Unicode characters.
+    Escape sequences in strings are decoded, \\uXXXX ones into
+    UTF-8 (surrogate pairs included): other characters are
+    stored as they are, so that a text in UTF-8 gives strings
+    in UTF-8.
 
 \verbatim
     json
@@ -146,11 +179,27 @@
 
 /* *** MODULE jstream *** */
             
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "jstream.h"
+#ifdef JSTREAM_STATS
+#include <time.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* *** PRIVATE STUFF *** */
 
@@ -163,67 +212,445 @@ static unsigned jstream_align(unsigned size)
         : 1 + size / sizeof(unsigned);
 }
 
-/** Expand the size of p->obj by n unsigned: the new value
-    of p->obj is updated and the address of the first
-    allocated additional array is returned. */
-static jstream_t jstream_expand(jstream_param_t p, unsigned n)
+/** Minimum capacity (in words) of a newly allocated p->obj. */
+#define JSTREAM_MINCAP 64
+
+/** Features of the parser, tested by the functions with an
+    argument f: each instance of jstream_value passes them a
+    constant f, so that the tests of the features it lacks are
+    removed at compile time (see jstream_value_f). */
+enum {
+    JSTREAM_F_EVENTS = 1,       ///< p->handler may be != NULL
+    JSTREAM_F_PATHS = 2,        ///< p->paths may be != NULL
+    JSTREAM_F_INTERN = 4,       ///< p->intern or p->intern_values may be set
+    JSTREAM_F_REFS = 8,         ///< p->text may be != NULL
+    JSTREAM_F_INTEGERS = 16,    ///< p->integers may be set
+    JSTREAM_F_SEAL = 32,        ///< p->index, p->packed or p->max_depth may be set
+    JSTREAM_F_ANY = 63          ///< all of them
+};
+
+/** Update the statistics of the parsing by the expression x,
+    e.g. JSTREAM_STAT(p, keys ++), if JSTREAM_STATS is defined
+    and p->stats is not NULL. */
+#ifdef JSTREAM_STATS
+#define JSTREAM_STAT(p, x) do { \
+        struct jstream_stats_s *stats_ = (p)->stats; \
+        if (stats_ != NULL) stats_->x; \
+    } while (0)
+#else
+#define JSTREAM_STAT(p, x) ((void) 0)
+#endif
+
+/** Inline a function specialized on f into each instance. */
+#if defined(__GNUC__) || defined(__clang__)
+#define JSTREAM_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define JSTREAM_INLINE static __forceinline
+#else
+#define JSTREAM_INLINE static inline
+#endif
+
+/** Resize the block ptr to size bytes (allocate it if ptr is
+    NULL) by means of the allocation hooks in *p. */
+static void *jstream_realloc(jstream_param_t p, void *ptr, size_t size)
 {
-    if (p->obj == NULL) {
-        p->obj = malloc(n * sizeof(unsigned));
-        if (p->obj == NULL) longjmp(p->env, ERR_MEMORY);
-        p->size = n;
-        return p->obj;
+    if (ptr == NULL)
+        return p->mem_alloc == NULL ? malloc(size)
+            : p->mem_alloc(p->mem_user, size);
+    return p->mem_realloc == NULL ? realloc(ptr, size)
+        : p->mem_realloc(p->mem_user, ptr, size);
+}
+
+/** Release the block p->obj and reset p->obj, p->size and
+    p->capacity. */
+static void jstream_drop(jstream_param_t p)
+{
+    if (p->obj != NULL) {
+        if (p->mem_free == NULL) free(p->obj);
+        else p->mem_free(p->mem_user, p->obj);
     }
-    unsigned newsize = p->size + n;
-    jstream_t objnew = realloc(p->obj, newsize * sizeof(unsigned));
+    p->obj = NULL;
+    p->size = 0;
+    p->capacity = 0;
+}
+
+/** Release the file of *size bytes at *map, kept mapped by
+    jstream_parse_file or jstream_load (or read into memory by
+    jstream_load, without mmap), if any, and reset *map and *size. */
+static void jstream_unmap(void **map, size_t *size)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    if (*map != NULL) munmap(*map, *size);
+#else
+    free(*map);
+#endif
+    *map = NULL;
+    *size = 0;
+}
+
+/** Resize p->obj to a capacity of cap words. */
+static void jstream_reserve(jstream_param_t p, unsigned cap)
+{
+    jstream_t objnew = jstream_realloc(p, p->obj, cap * sizeof(unsigned));
     if (objnew == NULL) longjmp(p->env, ERR_MEMORY);
+    JSTREAM_STAT(p, reallocs ++);
+    if (p->obj != NULL && objnew != p->obj)
+        JSTREAM_STAT(p, moved += (size_t) p->size * sizeof(unsigned));
     p->obj = objnew;
-    objnew += p->size;   // points to the new items
+    p->capacity = cap;
+}
+
+/** Enlarge p->obj so that n more unsigned fit into it: its
+    capacity is doubled until they do. */
+static void jstream_grow(jstream_param_t p, unsigned n)
+{
+    unsigned newsize = p->size + n;
+    if (newsize < p->size) longjmp(p->env, ERR_MEMORY);
+    unsigned cap = p->capacity < JSTREAM_MINCAP ? JSTREAM_MINCAP
+        : p->capacity;
+    while (cap < newsize)
+        cap = cap > UINT_MAX / 2 ? newsize : 2 * cap;
+    jstream_reserve(p, cap);
+}
+
+/** Expand the size of p->obj by n unsigned: the new value
+    of p->obj is updated and the address of the first
+    allocated additional array is returned. The capacity of
+    p->obj is doubled when it is exhausted. */
+static inline jstream_t jstream_expand(jstream_param_t p, unsigned n)
+{
+    // most of times there's room: that's checked inline
+    if (n > p->capacity - p->size) jstream_grow(p, n);
+    JSTREAM_STAT(p, expands ++);
+    unsigned newsize = p->size + n;
+    jstream_t objnew = p->obj + p->size;   // points to the new items
     p->size = newsize;
     return objnew;
 }
 
-/** Return the first non space character in the stream. */
-static int jstream_next(jstream_param_t p)
+/* *** SCANNING KERNELS *** */
+
+/** The scanning kernels look for the first character of some
+    kind inside a block [s, end) of the input buffer and return
+    its address (or end if there is none). Each of them comes
+    in a scalar version and in vectorized versions (SSE2 and
+    AVX2 on x86, NEON on ARM) that check 16 or 32 characters at
+    a time: the best version available on the running CPU is
+    chosen by jstream_kernels when parsing starts. */
+
+/** Return nonzero if c is a Json space character. */
+#define JSTREAM_ISSPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+/** Return the first non space character in [s, end). */
+static const char *jstream_space_scalar(const char *s, const char *end)
 {
-    while (strchr(" \r\t\n", p->clast = p->get()) != NULL)
-        ;
-    return p->clast;
+    while (s < end && JSTREAM_ISSPACE(*s)) ++ s;
+    return s;
 }
 
-/** Each function implementing a grammar class assumes
-    that the first character of the sequence to match
-    has already been parsed (it is found in p->clast).
-    Also, each function consume the first character
-    after the parsed value and stores it into p->clast. */
+/** Return the first '"' or '\\' in [s, end). */
+static const char *jstream_quote_scalar(const char *s, const char *end)
+{
+    while (s < end && *s != '"' && *s != '\\') ++ s;
+    return s;
+}
+
+/** Return the first '"', '[', ']', '{' or '}' in [s, end). */
+static const char *jstream_struct_scalar(const char *s, const char *end)
+{
+    while (s < end && *s != '"' && *s != '[' && *s != ']' && *s != '{' && *s != '}')
+        ++ s;
+    return s;
+}
 
-// Forward declarations
-static int jstream_object(jstream_param_t p);
-static int jstream_value(jstream_param_t p);
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define JSTREAM_X86
 
-static int jstream_array(jstream_param_t p)
+static const char *jstream_space_sse2(const char *s, const char *end)
 {
-    jstream_t objnew = jstream_expand(p, 2);
-    objnew[0] = ARRAY;
-    objnew[1] = 0;
-    // ilen is the index of the length of this object
-    size_t ilen = objnew + 1 - p->obj;
-    if (jstream_next(p) != ']') {
-        for (;;) {
-            ++ p->obj[ilen];
-            if (jstream_value(p) != ',') break;
-            jstream_next(p);    // jstream_value expect this
+    const __m128i sp = _mm_set1_epi8(' '), nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r'), tab = _mm_set1_epi8('\t');
+    for (; end - s >= 16; s += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) s);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, sp), _mm_cmpeq_epi8(x, nl)),
+            _mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, tab)));
+        unsigned mask = ~_mm_movemask_epi8(m) & 0xFFFF;
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_space_scalar(s, end);
+}
+
+static const char *jstream_quote_sse2(const char *s, const char *end)
+{
+    const __m128i qu = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    for (; end - s >= 16; s += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) s);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, qu), _mm_cmpeq_epi8(x, bs)));
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_quote_scalar(s, end);
+}
+
+static const char *jstream_struct_sse2(const char *s, const char *end)
+{
+    const __m128i qu = _mm_set1_epi8('"'), ob = _mm_set1_epi8('['), cb = _mm_set1_epi8(']');
+    const __m128i oc = _mm_set1_epi8('{'), cc = _mm_set1_epi8('}');
+    for (; end - s >= 16; s += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) s);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, qu),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, ob), _mm_cmpeq_epi8(x, cb)),
+                _mm_or_si128(_mm_cmpeq_epi8(x, oc), _mm_cmpeq_epi8(x, cc))));
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_struct_scalar(s, end);
+}
+
+__attribute__((target("avx2")))
+static const char *jstream_space_avx2(const char *s, const char *end)
+{
+    const __m256i sp = _mm256_set1_epi8(' '), nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r'), tab = _mm256_set1_epi8('\t');
+    for (; end - s >= 32; s += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) s);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, sp), _mm256_cmpeq_epi8(x, nl)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, cr), _mm256_cmpeq_epi8(x, tab)));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(m);
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_space_sse2(s, end);
+}
+
+__attribute__((target("avx2")))
+static const char *jstream_quote_avx2(const char *s, const char *end)
+{
+    const __m256i qu = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+    for (; end - s >= 32; s += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) s);
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, qu), _mm256_cmpeq_epi8(x, bs)));
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_quote_sse2(s, end);
+}
+
+__attribute__((target("avx2")))
+static const char *jstream_struct_avx2(const char *s, const char *end)
+{
+    const __m256i qu = _mm256_set1_epi8('"'), ob = _mm256_set1_epi8('['), cb = _mm256_set1_epi8(']');
+    const __m256i oc = _mm256_set1_epi8('{'), cc = _mm256_set1_epi8('}');
+    for (; end - s >= 32; s += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) s);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, qu),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, ob), _mm256_cmpeq_epi8(x, cb)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(x, oc), _mm256_cmpeq_epi8(x, cc))));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask != 0) return s + __builtin_ctz(mask);
+    }
+    return jstream_struct_sse2(s, end);
+}
+
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define JSTREAM_NEON
+
+/** Return the offset of the first nonzero byte of m, which is
+    a vector of 0x00/0xFF bytes, or 16 if they are all zero. */
+static inline unsigned jstream_neon_first(uint8x16_t m)
+{
+    // Narrow each byte to 4 bits, so that the mask fits 64 bits
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    return mask == 0 ? 16 : __builtin_ctzll(mask) >> 2;
+}
+
+static const char *jstream_space_neon(const char *s, const char *end)
+{
+    const uint8x16_t sp = vdupq_n_u8(' '), nl = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r'), tab = vdupq_n_u8('\t');
+    for (; end - s >= 16; s += 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t*) s);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(x, sp), vceqq_u8(x, nl)),
+            vorrq_u8(vceqq_u8(x, cr), vceqq_u8(x, tab)));
+        unsigned i = jstream_neon_first(vmvnq_u8(m));
+        if (i < 16) return s + i;
+    }
+    return jstream_space_scalar(s, end);
+}
+
+static const char *jstream_quote_neon(const char *s, const char *end)
+{
+    const uint8x16_t qu = vdupq_n_u8('"'), bs = vdupq_n_u8('\\');
+    for (; end - s >= 16; s += 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t*) s);
+        unsigned i = jstream_neon_first(vorrq_u8(vceqq_u8(x, qu), vceqq_u8(x, bs)));
+        if (i < 16) return s + i;
+    }
+    return jstream_quote_scalar(s, end);
+}
+
+static const char *jstream_struct_neon(const char *s, const char *end)
+{
+    const uint8x16_t qu = vdupq_n_u8('"'), ob = vdupq_n_u8('['), cb = vdupq_n_u8(']');
+    const uint8x16_t oc = vdupq_n_u8('{'), cc = vdupq_n_u8('}');
+    for (; end - s >= 16; s += 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t*) s);
+        uint8x16_t m = vorrq_u8(vceqq_u8(x, qu),
+            vorrq_u8(vorrq_u8(vceqq_u8(x, ob), vceqq_u8(x, cb)),
+                vorrq_u8(vceqq_u8(x, oc), vceqq_u8(x, cc))));
+        unsigned i = jstream_neon_first(m);
+        if (i < 16) return s + i;
+    }
+    return jstream_struct_scalar(s, end);
+}
+#endif
+
+/** Set the scanning kernels of *p to the best versions for the
+    running CPU. */
+static void jstream_kernels(jstream_param_t p)
+{
+#if defined(JSTREAM_X86)
+    if (__builtin_cpu_supports("avx2")) {
+        p->scan_space = jstream_space_avx2;
+        p->scan_quote = jstream_quote_avx2;
+        p->scan_struct = jstream_struct_avx2;
+    } else {
+        p->scan_space = jstream_space_sse2;
+        p->scan_quote = jstream_quote_sse2;
+        p->scan_struct = jstream_struct_sse2;
+    }
+#elif defined(JSTREAM_NEON)
+    p->scan_space = jstream_space_neon;
+    p->scan_quote = jstream_quote_neon;
+    p->scan_struct = jstream_struct_neon;
+#else
+    p->scan_space = jstream_space_scalar;
+    p->scan_quote = jstream_quote_scalar;
+    p->scan_struct = jstream_struct_scalar;
+#endif
+}
+
+/* *** INPUT *** */
+
+/** Refill the input buffer p->buf, either by a block read via
+    p->read or by a single character read via p->get (or via
+    p->get_r). Return 0 if the stream is over (which is always
+    the case when parsing a buffer, since it is all in memory). */
+static int jstream_fill(jstream_param_t p)
+{
+    if (p->base != NULL) return 0;
+    if (p->read != NULL) {
+        size_t n = p->read(p->ctx, p->buf, sizeof(p->buf));
+        if (n == 0) return 0;
+        JSTREAM_STAT(p, bytes += n);
+        p->cur = p->buf;
+        p->end = p->buf + n;
+        return 1;
+    }
+    if (p->get != NULL || p->get_r != NULL) {
+        int c = p->get != NULL ? p->get() : p->get_r(p->ctx);
+        if (c < 0) return 0;
+        JSTREAM_STAT(p, bytes ++);
+        p->buf[0] = c;
+        p->cur = p->buf;
+        p->end = p->buf + 1;
+        return 1;
+    }
+    return 0;
+}
+
+#if !defined(__unix__) && !defined(__APPLE__)
+/** The read function used by jstream_parse_file. */
+static size_t jstream_fread(void *ctx, char *buf, size_t cap)
+{
+    return fread(buf, 1, cap, ctx);
+}
+#endif
+
+/** Consume and return the next character in the stream, or
+    a negative value if the stream is over. */
+static inline int jstream_getc(jstream_param_t p)
+{
+    if (p->cur == p->end && !jstream_fill(p)) return -1;
+    return (unsigned char) *p->cur++;
+}
+
+/** Return the first non space character in the stream, when
+    the next character is a space or the buffer is empty. */
+static int jstream_next_space(jstream_param_t p)
+{
+    for (;;) {
+        if (p->cur < p->end) {
+            p->cur = p->scan_space(p->cur, p->end);
+            if (p->cur < p->end)
+                return p->clast = (unsigned char) *p->cur++;
         }
-        if (p->clast != ']') longjmp(p->env, ERR_CLOSED_BRACKET);
+        if (!jstream_fill(p)) return p->clast = -1;
     }
-    return jstream_next(p);
 }
 
+/** Return the first non space character in the stream. */
+static inline int jstream_next(jstream_param_t p)
+{
+    // Most of times no space at all: that's checked inline
+    if (p->cur < p->end && !JSTREAM_ISSPACE(*p->cur))
+        return p->clast = (unsigned char) *p->cur++;
+    return jstream_next_space(p);
+}
+
+/** In event mode, pass the scalar value just stored at
+    p->obj[i] to the handler and drop it from p->obj. */
+static void jstream_event(jstream_param_t p, size_t i)
+{
+    const struct jstream_handler_s *h = p->handler;
+    jstream_t v = p->obj + i;
+    int r = 0;
+    switch (v[0]) {
+    case 0 /* NULL */:
+        if (h->null != NULL) r = h->null(p->handler_ctx);
+        break;
+    case FALSE: case TRUE:
+        if (h->boolean != NULL) r = h->boolean(p->handler_ctx, v[0] == TRUE);
+        break;
+    case NUMBER:
+        if (h->number != NULL) r = h->number(p->handler_ctx, *(double*)(v + 1));
+        break;
+    case INTEGER:
+        if (h->integer != NULL) r = h->integer(p->handler_ctx, *(int64_t*)(v + 1));
+        break;
+    case STRING: case STRING_REF:
+        if (h->string != NULL) r = h->string(p->handler_ctx, jstream_str(v, NULL), v[1]);
+        break;
+    }
+    p->size = i;
+    if (r != 0) longjmp(p->env, ERR_HANDLER);
+}
+
+/** In event mode, call the handler f (which may be NULL) on
+    a container, passing it n if n >= 0. */
+static void jstream_event_container(jstream_param_t p,
+    int (*f)(void *ctx), int (*g)(void *ctx, unsigned n), unsigned n)
+{
+    int r = f != NULL ? f(p->handler_ctx)
+        : g != NULL ? g(p->handler_ctx, n) : 0;
+    if (r != 0) longjmp(p->env, ERR_HANDLER);
+}
+
+/** Each function implementing a grammar class assumes
+    that the first character of the sequence to match
+    has already been parsed (it is found in p->clast).
+    Also, each function consume the first character
+    after the parsed value and stores it into p->clast. */
+
 static int jstream_false(jstream_param_t p)
 {
     int c;
-    if (p->get() != 'a' || p->get() != 'l' || p->get() != 's' || p->get() != 'e'
-    || strchr(" \r\t\n]},:", p->clast = p->get()) == NULL)
+    if (jstream_getc(p) != 'a' || jstream_getc(p) != 'l' || jstream_getc(p) != 's' || jstream_getc(p) != 'e'
+    || ((p->clast = jstream_getc(p)) >= 0 && strchr(" \r\t\n]},:", p->clast) == NULL))
         longjmp(p->env, ERR_FALSE);
     jstream_t objnew = jstream_expand(p, 1);
     objnew[0] = FALSE;
@@ -234,8 +661,8 @@ static int jstream_false(jstream_param_t p)
 static int jstream_null(jstream_param_t p)
 {
     int c;
-    if (p->get() != 'u' || p->get() != 'l' || p->get() != 'l'
-    || strchr(" \r\t\n]},:", p->clast = p->get()) == NULL)
+    if (jstream_getc(p) != 'u' || jstream_getc(p) != 'l' || jstream_getc(p) != 'l'
+    || ((p->clast = jstream_getc(p)) >= 0 && strchr(" \r\t\n]},:", p->clast) == NULL))
         longjmp(p->env, ERR_NULL);
     jstream_t objnew = jstream_expand(p, 1);
     objnew[0] = (unsigned) NULL;
@@ -243,80 +670,551 @@ static int jstream_null(jstream_param_t p)
         : jstream_next(p);
 }
 
-static int jstream_number(jstream_param_t p)
+/** Return nonzero if c may appear inside a number. */
+#define JSTREAM_ISNUM(c) (((c) >= '0' && (c) <= '9') || (c) == '.' \
+    || (c) == '-' || (c) == '+' || (c) == 'e' || (c) == 'E')
+
+/** A number scanned from the text, whose value is
+    (-1)^neg * m * 10^exp. */
+struct jstream_number_s {
+    uint64_t m;         ///< first (at most 19) significant digits
+    int exp;            ///< decimal exponent
+    int neg;            ///< nonzero if the number is negative
+    int integer;        ///< nonzero if there's no fraction nor exponent
+    int inexact;        ///< nonzero if nonzero digits are missing from m
+};
+
+/** Scan the characters in [s, end) as a Json number, storing
+    it into *n: return 0 if they don't match the grammar. */
+static int jstream_scan_number(const char *s, const char *end,
+    struct jstream_number_s *n)
 {
-    int i;
-    static char buf[128];
-    buf[0] = p->clast;
-    for (i = 1; i < sizeof(buf); ++ i) {
-        buf[i] = p->get();
-        if (strchr("0123456789.+-eE", buf[i]) == NULL) {
-            p->clast = buf[i];
-            buf[i] = '\0';
-            break;
+    int digits = 0;     // significant digits stored in n->m
+    n->m = 0;
+    n->exp = 0;
+    n->neg = 0;
+    n->integer = 1;
+    n->inexact = 0;
+    if (s < end && *s == '-') {
+        n->neg = 1;
+        ++ s;
+    }
+    if (s == end) return 0;
+    if (*s == '0') {
+        ++ s;
+    } else if (*s >= '1' && *s <= '9') {
+        do {
+            if (digits < 19) {
+                n->m = 10 * n->m + (*s - '0');
+                ++ digits;
+            } else {
+                ++ n->exp;
+                n->inexact |= *s != '0';
+            }
+        } while (++ s < end && *s >= '0' && *s <= '9');
+    } else {
+        return 0;
+    }
+    if (s < end && *s == '.') {
+        n->integer = 0;
+        if (++ s == end || *s < '0' || *s > '9') return 0;
+        do {
+            if (digits < 19) {
+                n->m = 10 * n->m + (*s - '0');
+                -- n->exp;
+                digits += n->m != 0;    // leading zeros don't count
+            } else {
+                n->inexact |= *s != '0';
+            }
+        } while (++ s < end && *s >= '0' && *s <= '9');
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        int neg = 0, e = 0;
+        n->integer = 0;
+        if (++ s < end && (*s == '+' || *s == '-')) neg = *s++ == '-';
+        if (s == end || *s < '0' || *s > '9') return 0;
+        do {
+            if (e < 100000) e = 10 * e + (*s - '0');
+        } while (++ s < end && *s >= '0' && *s <= '9');
+        n->exp += neg ? -e : e;
+    }
+    return s == end;
+}
+
+/** Powers of 10 which are exactly represented as doubles. */
+static const double jstream_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/** Convert *n into the nearest double *d if this can be done
+    exactly with at most one floating point operation (this is
+    the "fast path" by W. D. Clinger): return 0 otherwise. */
+static int jstream_fast_double(const struct jstream_number_s *n, double *d)
+{
+    const uint64_t max = (uint64_t) 1 << 53;
+    double x;
+    if (n->inexact) return 0;
+    if (n->exp == 0 || n->m == 0) {
+        x = n->m;       // the conversion is correctly rounded
+    } else if (n->m > max) {
+        return 0;
+    } else if (n->exp < 0) {
+        if (n->exp < -22) return 0;
+        x = (double) n->m / jstream_pow10[-n->exp];
+    } else if (n->exp <= 22) {
+        x = (double) n->m * jstream_pow10[n->exp];
+    } else {
+        // Move the exceeding powers of 10 to m, if it stays exact
+        uint64_t m = n->m;
+        for (int e = n->exp; e > 22; -- e) {
+            if (m > max / 10) return 0;
+            m *= 10;
         }
+        x = (double) m * jstream_pow10[22];
     }
-    if (i == sizeof(buf)) longjmp(p->env, ERR_NUMBER_TOO_LONG);
-    char *s;
-    double d = strtod(buf, &s);
-    if (s != buf + strlen(buf)) longjmp(p->env, ERR_NUMBER);
-    jstream_t objnew = jstream_expand(p, 1 + sizeof(double)/sizeof(unsigned));
-    objnew[0] = NUMBER;
-    *(double*)(objnew + 1) = d;
-    return strchr(" \n\t\r", p->clast) == NULL ? p->clast
-        : jstream_next(p);
+    *d = n->neg ? -x : x;
+    return 1;
 }
 
-static int jstream_object(jstream_param_t p)
+/** Convert the number in [s, end) into a double via strtod,
+    used when jstream_fast_double fails. */
+static double jstream_slow_double(jstream_param_t p, const char *s,
+    const char *end)
 {
-    jstream_t objnew = jstream_expand(p, 2);
-    objnew[0] = OBJECT;
-    objnew[1] = 0;
-    // ilen is the index of the length of this object
-    size_t ilen = objnew + 1 - p->obj;
-    if (jstream_next(p) != '}') {
+    size_t n = end - s;
+    if (n >= sizeof(p->tmp)) longjmp(p->env, ERR_NUMBER_TOO_LONG);
+    memmove(p->tmp, s, n);
+    p->tmp[n] = '\0';
+    // strtod follows the locale, whose decimal point may not be '.'
+    char *dot = memchr(p->tmp, '.', n);
+    if (dot != NULL) *dot = *localeconv()->decimal_point;
+    return strtod(p->tmp, NULL);
+}
+
+JSTREAM_INLINE int jstream_number(jstream_param_t p, unsigned f)
+{
+    // The number starts with p->clast, that is p->cur[-1]
+    const char *s = p->cur - 1, *t = p->cur;
+    while (t < p->end && JSTREAM_ISNUM(*t)) ++ t;
+    p->cur = t;
+    if (t < p->end || p->base != NULL) {
+        // The number is inside the buffer: scan it in place
+        p->clast = jstream_getc(p);
+    } else {
+        /* The number may go on in the next block of the stream:
+            collect it into p->tmp. */
+        size_t n = t - s;
+        if (n >= sizeof(p->tmp)) longjmp(p->env, ERR_NUMBER_TOO_LONG);
+        memcpy(p->tmp, s, n);
         for (;;) {
-            ++ p->obj[ilen];
-            if (jstream_value(p) != ':') longjmp(p->env, ERR_COLON);
-            jstream_next(p);    // jstream_value expect this
-            if (jstream_value(p) == '}') break;
-            if (p->clast != ',') longjmp(p->env, ERR_COMMA);
-            jstream_next(p);    // jstream_value expect this
+            p->clast = jstream_getc(p);
+            if (!JSTREAM_ISNUM(p->clast)) break;
+            if (n == sizeof(p->tmp)) longjmp(p->env, ERR_NUMBER_TOO_LONG);
+            p->tmp[n ++] = p->clast;
         }
+        s = p->tmp;
+        t = p->tmp + n;
     }
-    return jstream_next(p);
+    struct jstream_number_s n;
+    double d;
+    if (!jstream_scan_number(s, t, &n)) longjmp(p->env, ERR_NUMBER);
+    if ((f & JSTREAM_F_INTEGERS) && p->integers && n.integer && !n.inexact && n.exp == 0
+    && n.m <= (uint64_t) INT64_MAX + n.neg) {
+        jstream_t objnew = jstream_expand(p, 1 + sizeof(int64_t)/sizeof(unsigned));
+        objnew[0] = INTEGER;
+        // -m is computed on unsigneds, since -INT64_MIN overflows
+        *(int64_t*)(objnew + 1) = n.neg ? (int64_t) (0 - n.m) : (int64_t) n.m;
+    } else {
+        if (!jstream_fast_double(&n, &d)) d = jstream_slow_double(p, s, t);
+        jstream_t objnew = jstream_expand(p, 1 + sizeof(double)/sizeof(unsigned));
+        objnew[0] = NUMBER;
+        *(double*)(objnew + 1) = d;
+    }
+    return JSTREAM_ISSPACE(p->clast) ? jstream_next(p) : p->clast;
 }
 
-static int jstream_string(jstream_param_t p)
+/** Hash function on keys (FNV-1a). */
+static unsigned jstream_hash_key(const char *s, size_t n)
 {
-#   define BUFNUM 16
-    static char buf[BUFNUM*sizeof(unsigned)];
-    jstream_t objnew = jstream_expand(p, 1);
+    unsigned h = 2166136261u;
+    while (n -- > 0) h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+/** Append to the object whose code is p->obj[iobj] a hash table
+    of its keys, and store its offset into the object header.
+    The table is an unsigned m (a power of 2) followed by m
+    slots, each of which is either 0 or the offset, from the
+    object code, of a key: keys are stored by open addressing
+    and linear probing. */
+static void jstream_index(jstream_param_t p, size_t iobj)
+{
+    unsigned n = p->obj[iobj + 1], m = 1;
+    while (m < 2 * n) m *= 2;
+    size_t itab = p->size;
+    memset(jstream_expand(p, 1 + m), 0, (1 + m) * sizeof(unsigned));
+    jstream_t obj = p->obj + iobj, table = p->obj + itab;
+    table[0] = m;
+    jstream_t key = obj + 4;
+    for (unsigned i = 0; i < n; ++ i) {
+        unsigned j = jstream_hash_key(jstream_str(key, NULL), key[1]) & (m - 1);
+        while (table[1 + j] != 0) j = (j + 1) & (m - 1);
+        table[1 + j] = key - obj;
+        key = jstream_skip(jstream_skip(key));
+    }
+    obj[3] = itab - iobj;
+}
+
+/** Empty the dictionary of the interned strings. */
+static void jstream_dict_clear(jstream_param_t p)
+{
+    if (p->dict_size > 0)
+        memset(p->dict, 0, 2 * p->dict_capacity * sizeof(unsigned));
+    p->dict_size = 0;
+}
+
+/** Double the capacity of the dictionary of the interned strings
+    (or allocate it), entering again the strings it contains. */
+static void jstream_dict_grow(jstream_param_t p)
+{
+    unsigned cap = p->dict_capacity == 0 ? 64 : 2 * p->dict_capacity;
+    unsigned *dict = jstream_realloc(p, NULL, 2 * cap * sizeof(unsigned));
+    if (dict == NULL) longjmp(p->env, ERR_MEMORY);
+    memset(dict, 0, 2 * cap * sizeof(unsigned));
+    for (unsigned i = 0; i < p->dict_capacity; ++ i) {
+        unsigned *e = p->dict + 2 * i;
+        if (e[1] == 0) continue;
+        unsigned j = e[0] & (cap - 1);
+        while (dict[2 * j + 1] != 0) j = (j + 1) & (cap - 1);
+        dict[2 * j] = e[0];
+        dict[2 * j + 1] = e[1];
+    }
+    if (p->dict != NULL) {
+        if (p->mem_free == NULL) free(p->dict);
+        else p->mem_free(p->mem_user, p->dict);
+    }
+    p->dict = dict;
+    p->dict_capacity = cap;
+}
+
+/** Intern the string just stored at p->obj[i]: if it is in the
+    dictionary, replace it by a SYMBOL referring to its first
+    occurrence, else enter it. The dictionary is an array of
+    pairs (hash, index + 1), looked up by linear probing. */
+static void jstream_intern(jstream_param_t p, size_t i)
+{
+    unsigned len;
+    const char *s = jstream_str(p->obj + i, &len);
+    unsigned h = jstream_hash_key(s, len);
+    if (2 * (p->dict_size + 1) > p->dict_capacity) jstream_dict_grow(p);
+    unsigned m = p->dict_capacity - 1, j = h & m;
+    for (unsigned *e; (e = p->dict + 2 * j)[1] != 0; j = (j + 1) & m) {
+        if (e[0] != h) continue;
+        jstream_t first = p->obj + e[1] - 1;
+        if (first[1] == len && memcmp(jstream_str(first, NULL), s, len) == 0) {
+            p->size = i;
+            jstream_t objnew = jstream_expand(p, 3);
+            objnew[0] = SYMBOL;
+            objnew[1] = len;
+            objnew[2] = i - (e[1] - 1);
+            return;
+        }
+    }
+    p->dict[2 * j] = h;
+    p->dict[2 * j + 1] = i + 1;
+    ++ p->dict_size;
+}
+
+/** Append the n characters at s to the string whose first
+    word is p->obj[istr] and whose length is len, expanding
+    p->obj to contain them plus a '\0': return the new length. */
+static unsigned jstream_append(jstream_param_t p, unsigned istr,
+    unsigned len, const char *s, size_t n)
+{
+    unsigned words = jstream_align(len + n + 1);
+    if (istr + words > p->size) jstream_expand(p, istr + words - p->size);
+    memcpy((char*)(p->obj + istr) + len, s, n);
+    return len + n;
+}
+
+/** Consume the next character in the stream, which must be a
+    hexadecimal digit, and return its value. */
+static unsigned jstream_hex(jstream_param_t p)
+{
+    int c = jstream_getc(p);
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;  // lower case
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    longjmp(p->env, c < 0 ? ERR_EOS_INSIDE_STRING : ERR_ESCAPE);
+}
+
+/** Decode the escape sequence following a '\\' in the stream into
+    the character it denotes, stored in s, which must have room
+    for 4 characters: return the number of characters stored. A
+    \\uXXXX sequence is stored in UTF-8, and a pair of them which
+    denotes a surrogate pair as the single character it stands
+    for: an unpaired surrogate is an error. */
+static unsigned jstream_unescape(jstream_param_t p, char *s)
+{
+    int c = jstream_getc(p);
+    switch (c) {
+    case '"': case '\\': case '/': *s = c; return 1;
+    case 'b': *s = '\b'; return 1;
+    case 'f': *s = '\f'; return 1;
+    case 'n': *s = '\n'; return 1;
+    case 'r': *s = '\r'; return 1;
+    case 't': *s = '\t'; return 1;
+    case 'u': break;
+    default: longjmp(p->env, c < 0 ? ERR_EOS_INSIDE_STRING : ERR_ESCAPE);
+    }
+    unsigned u = jstream_hex(p) << 12;
+    u |= jstream_hex(p) << 8;
+    u |= jstream_hex(p) << 4;
+    u |= jstream_hex(p);
+    if (u >= 0xD800 && u < 0xE000) {
+        // a high surrogate, which must be followed by a low one
+        if (u >= 0xDC00 || jstream_getc(p) != '\\' || jstream_getc(p) != 'u')
+            longjmp(p->env, ERR_ESCAPE);
+        unsigned l = jstream_hex(p) << 12;
+        l |= jstream_hex(p) << 8;
+        l |= jstream_hex(p) << 4;
+        l |= jstream_hex(p);
+        if (l < 0xDC00 || l >= 0xE000) longjmp(p->env, ERR_ESCAPE);
+        u = 0x10000 + ((u - 0xD800) << 10) + (l - 0xDC00);
+    }
+    if (u < 0x80) {
+        s[0] = u;
+        return 1;
+    }
+    if (u < 0x800) {
+        s[0] = 0xC0 | u >> 6;
+        s[1] = 0x80 | (u & 0x3F);
+        return 2;
+    }
+    if (u < 0x10000) {
+        s[0] = 0xE0 | u >> 12;
+        s[1] = 0x80 | (u >> 6 & 0x3F);
+        s[2] = 0x80 | (u & 0x3F);
+        return 3;
+    }
+    s[0] = 0xF0 | u >> 18;
+    s[1] = 0x80 | (u >> 12 & 0x3F);
+    s[2] = 0x80 | (u >> 6 & 0x3F);
+    s[3] = 0x80 | (u & 0x3F);
+    return 4;
+}
+
+JSTREAM_INLINE int jstream_string(jstream_param_t p, unsigned f)
+{
+    const char *q = p->scan_quote(p->cur, p->end);
+    if ((f & JSTREAM_F_REFS) && p->text != NULL && q < p->end && *q == '"'
+        && q - p->cur >= (ptrdiff_t) sizeof(char*)) {
+        /* No escapes: a reference to the characters in the buffer
+            (shorter strings take no more room when copied). */
+        jstream_t objnew = jstream_expand(p, 2 + sizeof(char*)/sizeof(unsigned));
+        objnew[0] = STRING_REF;
+        objnew[1] = q - p->cur;
+        *(const char**)(objnew + 2) = p->cur;
+        JSTREAM_STAT(p, longest_string = objnew[1] > stats_->longest_string
+            ? objnew[1] : stats_->longest_string);
+        p->cur = q + 1;
+        return jstream_next(p);
+    }
+    jstream_t objnew = jstream_expand(p, 2);
     objnew[0] = STRING;
-    // Scans the string until '"' or the text is over
-    int j;
+    unsigned istr = p->size;    // index of the first word of the string
+    unsigned len = 0;
+    /* Scans the string until '"' or the text is over, copying
+        each run of characters without escapes found in the input
+        buffer at once, and decoding each escape sequence. */
     for (;;) {
-        for (j = 0; j < sizeof(buf) && (p->clast = p->get()) != '"'; ++ j) {
-            if (p->clast < 0) longjmp(p->env, ERR_EOS_INSIDE_STRING);
-            buf[j] = p->clast;
-        }
-        if (j < sizeof(buf)) break;
-        /* The scanned string is longer than buf: dump buf and
-            reset it to scan the rest of the string. */
-        objnew = jstream_expand(p, BUFNUM);
-        memcpy(objnew, buf, sizeof(buf));
-    }
-    buf[j] = '\0';  // overwrites the ending '"'
-    objnew = jstream_expand(p, jstream_align(strlen(buf) + 1));
-    strcpy((char*)objnew, buf);
+        if (q > p->cur) len = jstream_append(p, istr, len, p->cur, q - p->cur);
+        p->cur = q;
+        if (q < p->end) {
+            ++ p->cur;
+            if (*q == '"') break;
+            char c[4];
+            len = jstream_append(p, istr, len, c, jstream_unescape(p, c));
+        } else if (!jstream_fill(p)) {
+            longjmp(p->env, ERR_EOS_INSIDE_STRING);
+        }
+        q = p->scan_quote(p->cur, p->end);
+    }
+    // the '\0' and the padding up to the end of the last word
+    jstream_append(p, istr, len, "", 0);
+    memset((char*)(p->obj + istr) + len, 0,
+        (p->size - istr) * sizeof(unsigned) - len);
+    p->obj[istr - 1] = len;
+    JSTREAM_STAT(p, longest_string = len > stats_->longest_string
+        ? len : stats_->longest_string);
     return jstream_next(p);
 }
 
+/** Parse the key of a member of an object, which must be a
+    string. */
+JSTREAM_INLINE int jstream_key(jstream_param_t p, unsigned f)
+{
+    if (p->clast != '"') longjmp(p->env, ERR_KEY);
+    return jstream_string(p, f);
+}
+
+/** Once the key stored at p->obj[i] has been kept, intern it or
+    pass it to the handler, as p says. */
+JSTREAM_INLINE void jstream_keep_key(jstream_param_t p, size_t i, unsigned f)
+{
+    if (!(f & JSTREAM_F_EVENTS) || p->handler == NULL) {
+        if ((f & JSTREAM_F_INTERN) && p->intern) jstream_intern(p, i);
+        return;
+    }
+    jstream_t v = p->obj + i;
+    int r = p->handler->key == NULL ? 0
+        : p->handler->key(p->handler_ctx, jstream_str(v, NULL), v[1]);
+    p->size = i;
+    if (r != 0) longjmp(p->env, ERR_HANDLER);
+}
+
+/* *** FILTERS *** */
+
+/** Mask of the paths which match a value in full, so that all of
+    it is kept (the other bits are those of the paths it matches
+    in part, so that some of its items are kept). */
+#define JSTREAM_ALL ((uint64_t) 1 << 63)
+
+/** Skip the rest of a string whose '"' has been consumed. */
+static void jstream_skip_string(jstream_param_t p)
+{
+    for (;;) {
+        if (p->cur == p->end && !jstream_fill(p))
+            longjmp(p->env, ERR_EOS_INSIDE_STRING);
+        const char *q = p->scan_quote(p->cur, p->end);
+        if (q == p->end) {
+            p->cur = q;
+            continue;
+        }
+        p->cur = q + 1;
+        if (*q == '"') return;
+        if (jstream_getc(p) < 0) longjmp(p->env, ERR_EOS_INSIDE_STRING);
+    }
+}
+
+/** Skip the value starting with p->clast, just finding where it
+    ends: inside arrays and objects only strings and brackets
+    are tracked. Return the first non space character after it. */
+static int jstream_skip_text(jstream_param_t p)
+{
+    int c = p->clast;
+    if (c == '"') {
+        jstream_skip_string(p);
+        return jstream_next(p);
+    }
+    if (c != '[' && c != '{') {
+        // a number or a literal, up to the next delimiter
+        if (c < 0 || strchr("-0123456789ftn", c) == NULL || c == 0)
+            longjmp(p->env, ERR_VALUE);
+        for (;;) {
+            if (p->cur == p->end && !jstream_fill(p)) return p->clast = -1;
+            c = *p->cur;
+            if (c == ',' || c == ']' || c == '}' || JSTREAM_ISSPACE(c))
+                return jstream_next(p);
+            ++ p->cur;
+        }
+    }
+    unsigned depth = 1;
+    for (;;) {
+        if (p->cur == p->end && !jstream_fill(p))
+            longjmp(p->env, ERR_CLOSED_BRACKET);
+        const char *s = p->scan_struct(p->cur, p->end);
+        p->cur = s;
+        if (s == p->end) continue;
+        c = *p->cur ++;
+        if (c == '"') {
+            jstream_skip_string(p);
+        } else if (c == '[' || c == '{') {
+            ++ depth;
+        } else if (-- depth == 0) {
+            return jstream_next(p);
+        }
+    }
+}
+
+const char *jstream_pointer_token(const char *path, unsigned k, size_t *len)
+{
+    for (;; -- k) {
+        if (*path != '/') return NULL;
+        const char *t = ++ path;
+        while (*path != '\0' && *path != '/') ++ path;
+        if (k == 0) {
+            *len = path - t;
+            return t;
+        }
+    }
+}
+
+int jstream_pointer_key(const char *t, size_t n, const char *key, size_t len)
+{
+    const char *end = t + n;
+    for (; t < end; ++ t, ++ key, -- len) {
+        char c = *t;
+        if (c == '~' && t + 1 < end) c = *++ t == '0' ? '~' : '/';
+        if (len == 0 || *key != c) return 0;
+    }
+    return len == 0;
+}
+
+/** Return nonzero if the token t of n characters is the decimal
+    representation of index. */
+static int jstream_token_index(const char *t, size_t n, unsigned index)
+{
+    if (n == 0 || n > 10 || (*t == '0' && n > 1)) return 0;
+    uint64_t k = 0;
+    for (size_t i = 0; i < n; ++ i) {
+        if (t[i] < '0' || t[i] > '9') return 0;
+        k = 10 * k + (t[i] - '0');
+    }
+    return k == index;
+}
+
+/** Return the mask of the paths matching the root value. */
+static uint64_t jstream_filter_root(jstream_param_t p)
+{
+    if (p->paths == NULL) return JSTREAM_ALL;
+    uint64_t m = 0;
+    for (unsigned k = 0; k < 63 && p->paths[k] != NULL; ++ k) {
+        if (p->paths[k][0] == '\0') return JSTREAM_ALL;    // "" is the root
+        m |= (uint64_t) 1 << k;
+    }
+    return m;
+}
+
+/** Return the mask of the paths matching the item, with the given
+    key (of len characters) or, if key is NULL, with the given
+    index, of the innermost open container, matched by the paths
+    in live. */
+static uint64_t jstream_filter(jstream_param_t p, uint64_t live,
+    const char *key, size_t len, unsigned index)
+{
+    if (live & JSTREAM_ALL) return JSTREAM_ALL;
+    uint64_t m = 0;
+    for (unsigned k = 0; live != 0; ++ k, live >>= 1) {
+        if (!(live & 1)) continue;
+        size_t n;
+        const char *t = jstream_pointer_token(p->paths[k], p->depth - 1, &n);
+        if (t == NULL) continue;
+        if (!(n == 1 && *t == '*') && !(key != NULL ? jstream_pointer_key(t, n, key, len)
+                : jstream_token_index(t, n, index)))
+            continue;
+        if (t[n] == '\0') return JSTREAM_ALL;  // the last token
+        m |= (uint64_t) 1 << k;
+    }
+    return m;
+}
+
 static int jstream_true(jstream_param_t p)
 {
     int c;
-    if (p->get() != 'r' || p->get() != 'u' || p->get() != 'e'
-    || strchr(" \r\t\n]},:", p->clast = p->get()) == NULL)
+    if (jstream_getc(p) != 'r' || jstream_getc(p) != 'u' || jstream_getc(p) != 'e'
+    || ((p->clast = jstream_getc(p)) >= 0 && strchr(" \r\t\n]},:", p->clast) == NULL))
             longjmp(p->env, ERR_TRUE);
     jstream_t objnew = jstream_expand(p, 1);
     objnew[0] = TRUE;
@@ -324,91 +1222,1452 @@ static int jstream_true(jstream_param_t p)
         : jstream_next(p);
 }
 
-static int jstream_value(jstream_param_t p)
+/** Double the capacity of p->stack: once it outgrows p->stack0
+    it is moved to the heap. */
+static void jstream_stack_grow(jstream_param_t p)
 {
-    switch (p->clast) {
-        case '[': return jstream_array(p);
-        case '{': return jstream_object(p);
-        case '"': return jstream_string(p);
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-        case '-': return jstream_number(p);
-        case 'f': return jstream_false(p);
-        case 'n': return jstream_null(p);
-        case 't': return jstream_true(p);
+    unsigned cap = 2 * p->stack_capacity;
+    unsigned *stack = jstream_realloc(p,
+        p->stack == p->stack0 ? NULL : p->stack, cap * sizeof(unsigned));
+    if (stack == NULL) longjmp(p->env, ERR_MEMORY);
+    if (p->stack == p->stack0)
+        memcpy(stack, p->stack0, sizeof(p->stack0));
+    p->stack = stack;
+    if (p->paths != NULL) {
+        // the levels grow along with the stack
+        struct jstream_level_s *levels = jstream_realloc(p,
+            p->levels == p->levels0 ? NULL : p->levels,
+            cap * sizeof(struct jstream_level_s));
+        if (levels == NULL) longjmp(p->env, ERR_MEMORY);
+        if (p->levels == p->levels0)
+            memcpy(levels, p->levels0, sizeof(p->levels0));
+        p->levels = levels;
     }
-    longjmp(p->env, ERR_VALUE);
+    p->stack_capacity = cap;
 }
 
-/* *** PUBLIC STUFF *** */
+/** Open an array or an object, as code says, whose first
+    character is p->clast, and push it onto the stack of the
+    open containers, matched by the paths in live: return the
+    index of its length. */
+JSTREAM_INLINE unsigned jstream_open(jstream_param_t p, unsigned code,
+    uint64_t live, unsigned f)
+{
+    if ((f & JSTREAM_F_SEAL) && p->depth == p->max_depth && p->max_depth != 0)
+        longjmp(p->env, ERR_DEPTH);
+    if (p->depth == p->stack_capacity) jstream_stack_grow(p);
+    jstream_t objnew = jstream_expand(p, code == ARRAY ? 3 : 4);
+    objnew[0] = code;
+    objnew[1] = 0;
+    if (code == OBJECT) objnew[3] = 0;
+    unsigned ilen = objnew + 1 - p->obj;
+    if ((f & JSTREAM_F_PATHS) && p->paths != NULL) {
+        p->levels[p->depth].live = live;
+        p->levels[p->depth].index = 0;
+    }
+    p->stack[p->depth ++] = ilen;
+    JSTREAM_STAT(p, values[code] ++);
+    JSTREAM_STAT(p, max_depth = p->depth > stats_->max_depth
+        ? p->depth : stats_->max_depth);
+    if ((f & JSTREAM_F_EVENTS) && p->handler != NULL)
+        jstream_event_container(p, code == ARRAY ? p->handler->begin_array
+            : p->handler->begin_object, NULL, 0);
+    return ilen;
+}
 
-jstream_t jstream(jstream_param_t p)
+/** Pack the array just closed, whose length is p->obj[ilen],
+    into an ARRAY_F64 or ARRAY_I64 value if its elements are all
+    numbers: they are moved in place, from the first one, since
+    each of them takes less room once packed. */
+static void jstream_pack(jstream_param_t p, unsigned ilen)
 {
-    int e;
-    p->obj = NULL;
-    p->size = 0;
-    p->clast = -1;
-    if ((p->error = setjmp(p->env)) == ERR_NONE) {
-        jstream_next(p);    // jstream_value expect this
-        jstream_value(p);
-        return p->obj;
+    const unsigned words = 1 + sizeof(double)/sizeof(unsigned);
+    unsigned n = p->obj[ilen];
+    if (p->size - ilen != 2 + n * words) return;
+    jstream_t v = p->obj + ilen + 2;
+    int doubles = 0, inexact = 0;
+    for (unsigned i = 0; i < n; ++ i, v += words) {
+        if (v[0] == NUMBER) {
+            doubles = 1;
+        } else if (v[0] != INTEGER) {
+            return;
+        } else {
+            int64_t k = *(int64_t*)(v + 1);
+            if (k > (1LL << 53) || k < -(1LL << 53)) inexact = 1;
+        }
     }
-    if (p->obj != NULL) {
-        free(p->obj);
-        p->obj = NULL;
+    if (doubles && inexact) return;
+    // the first element is aligned to 8 bytes
+    size_t idata = ilen + 3;
+    idata += (idata * sizeof(unsigned)) % 8 / sizeof(unsigned);
+    v = p->obj + ilen + 2;
+    /* The first element may overwrite the code of the second one,
+        which is thus read in advance. */
+    unsigned code = v[0];
+    for (unsigned i = 0; i < n; ++ i, v += words) {
+        int64_t k;
+        double d;
+        memcpy(&k, v + 1, sizeof(k));
+        if (doubles && code == INTEGER) {
+            d = k;
+            memcpy(&k, &d, sizeof(k));
+        }
+        code = i + 1 < n ? v[words] : 0;
+        memcpy(p->obj + idata + i * (words - 1), &k, sizeof(k));
     }
-    return NULL;
+    p->obj[ilen - 1] = doubles ? ARRAY_F64 : ARRAY_I64;
+    JSTREAM_STAT(p, values[ARRAY] --);
+    JSTREAM_STAT(p, values[p->obj[ilen - 1]] ++);
+    p->obj[ilen + 2] = idata - (ilen - 1);
+    p->size = idata + n * (words - 1);
 }
 
-jstream_t jstream_dump(FILE *f, jstream_t obj)
+/** Complete the container whose length is p->obj[ilen], whose
+    last item is the last one of p->obj: index or pack it, as p
+    says, and store its span. */
+static void jstream_seal(jstream_param_t p, unsigned ilen)
 {
-    switch (obj[0]) {
-    case 0 /* NULL */:
-        fputs("null", f);
-        return obj + 1;
-    case FALSE:
-        fputs("false", f);
+    unsigned code = p->obj[ilen - 1];
+    if (code == OBJECT && p->index != 0 && p->obj[ilen] >= p->index)
+        jstream_index(p, ilen - 1);
+    else if (code == ARRAY && p->packed != 0 && p->obj[ilen] >= p->packed)
+        jstream_pack(p, ilen);
+    // the span, from the code to the last word of the last value
+    p->obj[ilen + 1] = p->size - ilen + 1;
+}
+
+/** Close the innermost open container, whose last character
+    is p->clast, and pop it from the stack. */
+JSTREAM_INLINE int jstream_close(jstream_param_t p, unsigned f)
+{
+    unsigned ilen = p->stack[-- p->depth];
+    unsigned code = p->obj[ilen - 1];
+    if ((f & JSTREAM_F_EVENTS) && p->handler != NULL) {
+        jstream_event_container(p, NULL, code == ARRAY ? p->handler->end_array
+            : p->handler->end_object, p->obj[ilen]);
+        p->size = ilen - 1;
+        return jstream_next(p);
+    }
+    if (f & JSTREAM_F_SEAL) jstream_seal(p, ilen);
+    else p->obj[ilen + 1] = p->size - ilen + 1;     // just the span
+    return jstream_next(p);
+}
+
+/** Return the mask of the paths matching the item just started
+    with p->clast in the innermost container, whose key is at
+    p->obj[i] (unless key is 0): if the item is to be skipped,
+    this is 0 (and also if it only matches in part, but is not
+    an array nor an object). */
+static uint64_t jstream_item(jstream_param_t p, size_t i, int key)
+{
+    struct jstream_level_s *l = p->levels + p->depth - 1;
+    unsigned len = 0;
+    const char *s = key ? jstream_str(p->obj + i, &len) : NULL;
+    uint64_t m = jstream_filter(p, l->live, s, len, l->index ++);
+    if (!(m & JSTREAM_ALL) && p->clast != '[' && p->clast != '{') m = 0;
+    return m;
+}
+
+/** Parse the key of a new member of the open object whose length
+    is p->obj[ilen], starting with p->clast, and its ':': return
+    the mask of the paths matching the value, which is 0 if it
+    is to be skipped (then the key is dropped). */
+JSTREAM_INLINE uint64_t jstream_member(jstream_param_t p, unsigned ilen, unsigned f)
+{
+    size_t i = p->size;
+    if (jstream_key(p, f) != ':') longjmp(p->env, ERR_COLON);
+    jstream_next(p);    // jstream_value expect this
+    uint64_t m = JSTREAM_ALL;
+    if ((f & JSTREAM_F_PATHS) && p->paths != NULL && (m = jstream_item(p, i, 1)) == 0) {
+        p->size = i;
+        return 0;
+    }
+    ++ p->obj[ilen];
+    jstream_keep_key(p, i, f);
+    JSTREAM_STAT(p, keys ++);
+    return m;
+}
+
+/** Count a new element of the open array whose length is
+    p->obj[ilen], starting with p->clast: return the mask of the
+    paths matching it, which is 0 if it is to be skipped. */
+JSTREAM_INLINE uint64_t jstream_element(jstream_param_t p, unsigned ilen, unsigned f)
+{
+    uint64_t m = JSTREAM_ALL;
+    if ((f & JSTREAM_F_PATHS) && p->paths != NULL && (m = jstream_item(p, 0, 0)) == 0) return 0;
+    ++ p->obj[ilen];
+    return m;
+}
+
+/** Parse a value: arrays and objects are parsed without any
+    recursion, by keeping the open ones in p->stack, so that the
+    depth of the text only affects the size of the stack. The
+    features which may be used are f: this function is only
+    inlined into its instances, with constant values of f. */
+JSTREAM_INLINE int jstream_value_f(jstream_param_t p, unsigned f)
+{
+    unsigned ilen = 0;  // index of the length of the innermost container
+    int close = 0;      // character closing it (0 at top level)
+    // paths matching the value
+    uint64_t m = f & JSTREAM_F_PATHS ? jstream_filter_root(p) : JSTREAM_ALL;
+    for (;;) {
+        // a value starts with p->clast
+        size_t i = p->size;
+        int c;
+        if ((f & JSTREAM_F_PATHS) && m == 0 && close != 0)
+            c = jstream_skip_text(p);   // the root is kept
+        else switch (p->clast) {
+        case '[':
+            ilen = jstream_open(p, ARRAY, m, f);
+            close = ']';
+            if ((c = jstream_next(p)) != ']') {
+                m = jstream_element(p, ilen, f);
+                continue;   // the first element
+            }
+            break;
+        case '{':
+            ilen = jstream_open(p, OBJECT, m, f);
+            close = '}';
+            if ((c = jstream_next(p)) != '}') {
+                m = jstream_member(p, ilen, f);
+                continue;   // the first value
+            }
+            break;
+        case '"':
+            c = jstream_string(p, f);
+            if ((f & JSTREAM_F_INTERN) && p->intern_values != 0
+                && p->obj[i + 1] <= p->intern_values && p->handler == NULL)
+                jstream_intern(p, i);
+            break;
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+        case '-': c = jstream_number(p, f); break;
+        case 'f': c = jstream_false(p); break;
+        case 'n': c = jstream_null(p); break;
+        case 't': c = jstream_true(p); break;
+        default: longjmp(p->env, ERR_VALUE);
+        }
+        // the scalar stored at i, if any (a filter may have skipped
+        // it, and empty containers are already counted)
+        if (p->size > i)
+            JSTREAM_STAT(p, values[p->obj[i]] += p->obj[i] != ARRAY
+                && p->obj[i] != OBJECT);
+        // in event mode only a scalar leaves something after i
+        if ((f & JSTREAM_F_EVENTS) && p->handler != NULL && p->size > i)
+            jstream_event(p, i);
+        /* The value is over and c follows it: close the containers
+            which end here, until an item follows a ','. */
+        for (;;) {
+            if (close == 0) return c;
+            if (c != close) break;
+            c = jstream_close(p, f);
+            if (p->depth == 0) {
+                close = 0;
+            } else {
+                ilen = p->stack[p->depth - 1];
+                close = p->obj[ilen - 1] == ARRAY ? ']' : '}';
+            }
+        }
+        if (c != ',') longjmp(p->env, close == ']' ? ERR_CLOSED_BRACKET : ERR_COMMA);
+        jstream_next(p);    // jstream_value expect this
+        m = close == ']' ? jstream_element(p, ilen, f) : jstream_member(p, ilen, f);
+    }
+}
+
+/** Instances of jstream_value_f: jstream_value_tree parses into a
+    block without events, paths, interning, indexes, packing nor
+    a maximum depth (integers and refs, which only cost a branch
+    per number or string, are still tested), while
+    jstream_value_any tests all of the options. */
+static int jstream_value_tree(jstream_param_t p)
+{
+    return jstream_value_f(p, JSTREAM_F_INTEGERS | JSTREAM_F_REFS);
+}
+
+static int jstream_value_any(jstream_param_t p)
+{
+    return jstream_value_f(p, JSTREAM_F_ANY);
+}
+
+/** Parse a value by the instance of jstream_value_f for the
+    features used by p. */
+static int jstream_value(jstream_param_t p)
+{
+    if (p->handler == NULL && p->paths == NULL && !p->intern
+        && p->intern_values == 0 && p->index == 0 && p->packed == 0
+        && p->max_depth == 0)
+        return jstream_value_tree(p);
+    return jstream_value_any(p);
+}
+
+/* *** OUTPUT *** */
+
+/** Make room for n more characters (plus a '\0') in the buffer
+    of w: if w->write is not NULL the buffer is flushed, else it
+    is enlarged, by doubling its capacity. */
+static void jstream_room(jstream_writer_t w, size_t n)
+{
+    if (w->buf == NULL || w->write != NULL) {
+        if (w->buf == NULL) {
+            size_t cap = w->write != NULL ? JSTREAM_BUFSIZE : 2 * n + 256;
+            w->buf = w->mem_alloc == NULL ? malloc(cap)
+                : w->mem_alloc(w->mem_user, cap);
+            if (w->buf == NULL) longjmp(w->env, ERR_MEMORY);
+            w->capacity = cap;
+            w->own = 1;
+        }
+        if (jstream_flush(w) != ERR_NONE) longjmp(w->env, w->error);
+        if (n < w->capacity) return;
+    }
+    if (w->write != NULL) return;   // the characters are written directly
+    size_t cap = 2 * w->capacity;
+    if (cap < w->size + n + 1) cap = w->size + n + 1;
+    char *buf;
+    if (w->own) {
+        buf = w->mem_realloc == NULL ? realloc(w->buf, cap)
+            : w->mem_realloc(w->mem_user, w->buf, cap);
+    } else {
+        // the buffer of the caller is copied, not reallocated
+        buf = w->mem_alloc == NULL ? malloc(cap)
+            : w->mem_alloc(w->mem_user, cap);
+        if (buf != NULL) memcpy(buf, w->buf, w->size);
+    }
+    if (buf == NULL) longjmp(w->env, ERR_MEMORY);
+    w->buf = buf;
+    w->capacity = cap;
+    w->own = 1;
+}
+
+/** Append the n characters at s to the buffer of w. */
+static inline void jstream_put(jstream_writer_t w, const char *s, size_t n)
+{
+    if (n >= w->capacity - w->size) {
+        jstream_room(w, n);
+        if (n >= w->capacity) {
+            // too long for the buffer: written directly
+            if (w->write(w->ctx, s, n) != n) longjmp(w->env, ERR_FILE);
+            return;
+        }
+    }
+    memcpy(w->buf + w->size, s, n);
+    w->size += n;
+}
+
+/** Append the character c to the buffer of w. */
+static inline void jstream_putc(jstream_writer_t w, char c)
+{
+    if (w->size + 1 >= w->capacity) jstream_room(w, 1);
+    w->buf[w->size ++] = c;
+}
+
+/** Start a new line, indented by w->depth levels. */
+static void jstream_newline(jstream_writer_t w)
+{
+    static const char spaces[] = "                                ";
+    jstream_putc(w, '\n');
+    for (size_t n = (size_t) w->indent * w->depth; n > 0; ) {
+        size_t m = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        jstream_put(w, spaces, m);
+        n -= m;
+    }
+}
+
+/** Write the decimal digits of u backwards from end (at most
+    20 of them): return the address of the first one. */
+static char *jstream_utoa(char *end, uint64_t u)
+{
+    do {
+        *-- end = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    return end;
+}
+
+/** Write x into s (of at least 32 characters) with the shortest
+    sequence of significant digits which strtod converts back to
+    x, and return its length. Most values (those with few digits,
+    as the ones read from Json texts usually are) are found by
+    looking for the least k such that x * 10^k is an integer m
+    and m / 10^k is x, which is exact by Clinger's argument: else
+    %.15g, %.16g and %.17g are tried in turn, since the first of
+    them which reads back as x gives the shortest digits, padded
+    with zeros which %g drops. Subnormal values have less than
+    15 significant digits, so that for them the precision starts
+    from 1. */
+static size_t jstream_format_double(char *s, double x)
+{
+    if (!isfinite(x)) {
+        memcpy(s, "null", 4);   // Json has no infinities nor NaNs
+        return 4;
+    }
+    char *t = s;
+    if (signbit(x)) {
+        *t ++ = '-';
+        x = -x;
+    }
+    for (int k = 0; k < 18; ++ k) {
+        double m = x * jstream_pow10[k];
+        if (m >= 9007199254740992.0) break;     // 2^53
+        uint64_t u = (uint64_t) (m + 0.5);
+        if ((double) u / jstream_pow10[k] != x) continue;
+        char digits[20], *d = jstream_utoa(digits + 20, u);
+        size_t n = digits + 20 - d;
+        if (n <= (size_t) k) {
+            // 0.00ddd
+            *t ++ = '0';
+            *t ++ = '.';
+            memset(t, '0', k - n);
+            t += k - n;
+            memcpy(t, d, n);
+            t += n;
+        } else {
+            memcpy(t, d, n - k);
+            t += n - k;
+            if (k > 0) {
+                *t ++ = '.';
+                memcpy(t, d + n - k, k);
+                t += k;
+            }
+        }
+        return t - s;
+    }
+    int n;
+    for (int prec = x < DBL_MIN ? 1 : 15; ; ++ prec) {
+        n = snprintf(t, 31, "%.*g", prec, x);
+        if (prec == 17 || strtod(t, NULL) == x) break;
+    }
+    // snprintf follows the locale, whose decimal point may not be '.'
+    char point = *localeconv()->decimal_point;
+    if (point != '.') {
+        char *dot = memchr(t, point, n);
+        if (dot != NULL) *dot = '.';
+    }
+    return t - s + n;
+}
+
+/** Escape sequences of characters in Json strings: 0 if the
+    character is written as is, else the character following
+    the '\\' ('u' meaning \\u00XX). */
+static const char jstream_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"', ['\\'] = '\\'
+};
+
+/** Return nonzero if one of the 8 characters packed in x needs
+    an escape, that is if it is a control character or '"' or
+    '\\' (the usual tricks to find zero bytes in a word). */
+static inline int jstream_escape_word(uint64_t x)
+{
+    const uint64_t ones = 0x0101010101010101u, high = ones << 7;
+    uint64_t q = x ^ (ones * '"'), b = x ^ (ones * '\\');
+    return ((((x - ones * 0x20) & ~x) | ((q - ones) & ~q) | ((b - ones) & ~b))
+        & high) != 0;
+}
+
+/** Write the n characters at s as a Json string into the buffer
+    of w, copying runs of characters which need no escape at
+    once: they are looked for 8 characters at a time. */
+static void jstream_write_string(jstream_writer_t w, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *t = (const unsigned char*) s, *end = t + n;
+    jstream_putc(w, '"');
+    for (;;) {
+        const unsigned char *r = t;
+        for (uint64_t x; end - r >= 8; r += 8) {
+            memcpy(&x, r, 8);
+            if (jstream_escape_word(x)) break;
+        }
+        while (r < end && jstream_escapes[*r] == 0) ++ r;
+        jstream_put(w, (const char*) t, r - t);
+        if (r == end) break;
+        char e[6] = {'\\', jstream_escapes[*r], '0', '0', hex[*r >> 4], hex[*r & 15]};
+        jstream_put(w, e, e[1] == 'u' ? 6 : 2);
+        t = r + 1;
+    }
+    jstream_putc(w, '"');
+}
+
+/** Write the integer i into the buffer of w. */
+static void jstream_write_int(jstream_writer_t w, int64_t i)
+{
+    char tmp[24];
+    char *d = jstream_utoa(tmp + sizeof(tmp),
+        i < 0 ? -(uint64_t) i : (uint64_t) i);
+    if (i < 0) *-- d = '-';
+    jstream_put(w, d, tmp + sizeof(tmp) - d);
+}
+
+/** Write the packed array obj into the buffer of w, laid out as
+    the other arrays. */
+static void jstream_write_packed(jstream_writer_t w, jstream_t obj)
+{
+    unsigned n = obj[1];
+    if (n == 0) {
+        jstream_put(w, "[]", 2);
+        return;
+    }
+    jstream_putc(w, '[');
+    ++ w->depth;
+    for (unsigned i = 0; i < n; ++ i) {
+        if (i > 0) jstream_putc(w, ',');
+        if (w->indent != 0) jstream_newline(w);
+        if (obj[0] == ARRAY_I64) {
+            jstream_write_int(w, jstream_i64(obj, NULL)[i]);
+        } else {
+            char tmp[32];
+            jstream_put(w, tmp, jstream_format_double(tmp, jstream_f64(obj, NULL)[i]));
+        }
+    }
+    -- w->depth;
+    if (w->indent != 0) jstream_newline(w);
+    jstream_putc(w, ']');
+}
+
+/** Write the scalar value obj into the buffer of w: return the
+    address of the first item following it. */
+static jstream_t jstream_write_scalar(jstream_writer_t w, jstream_t obj)
+{
+    char tmp[32];
+    switch (obj[0]) {
+    case 0 /* NULL */:
+        jstream_put(w, "null", 4);
+        return obj + 1;
+    case FALSE:
+        jstream_put(w, "false", 5);
         return obj + 1;
     case TRUE:
-        fputs("true", f);
+        jstream_put(w, "true", 4);
         return obj + 1;
     case NUMBER:
-        fprintf(f, "%g", *(double*)(obj + 1));
+        jstream_put(w, tmp, jstream_format_double(tmp, *(double*)(obj + 1)));
         return obj + 1 + sizeof(double)/sizeof(unsigned);
-    case STRING: {
-        fputc('"', f); fputs((char*)(obj + 1), f); fputc('"', f);
-        return obj + 1 + jstream_align(strlen((char*)(obj + 1)) + 1);   // + 1 for the '\0'
-    }
-    case ARRAY: {
-        fputc('[', f);
-        unsigned len = obj[1];
-        jstream_t next = obj + 2;
-        for (unsigned i = 0; i < len; ++ i) {
-            next = jstream_dump(f, next);
-            if (i + 1 < len) fputc(',', f);
-        }
-        fputc(']', f);
-        return next;
-    }
-    case OBJECT: {
-        fputc('{', f);
-        unsigned len = obj[1];
-        jstream_t next = obj + 2;
-        for (unsigned i = 0; i < len; ++ i) {
-            next = jstream_dump(f, next);
-            fputc(':', f);
-            next = jstream_dump(f, next);
-            if (i + 1 < len) fputc(',', f);
-        }
-        fputc('}', f);
-        return next;
-    }
-    default:
-        fprintf(f, "Invalid object code: %u at %p\n", obj[0], obj);
+    case INTEGER:
+        jstream_write_int(w, *(int64_t*)(obj + 1));
+        return obj + 1 + sizeof(int64_t)/sizeof(unsigned);
+    case ARRAY_F64: case ARRAY_I64:
+        jstream_write_packed(w, obj);
+        return obj + obj[2];
+    case STRING:
+        jstream_write_string(w, (char*)(obj + 2), obj[1]);
+        return obj + 2 + jstream_align(obj[1] + 1);   // + 1 for the '\0'
+    case STRING_REF:
+        jstream_write_string(w, *(const char**)(obj + 2), obj[1]);
+        return obj + 2 + sizeof(char*)/sizeof(unsigned);
+    case SYMBOL:
+        jstream_write_string(w, jstream_str(obj, NULL), obj[1]);
+        return obj + 3;
+    }
+    longjmp(w->env, ERR_VALUE);
+}
+
+/** Write the key obj of a member, and the following ':', into
+    the buffer of w: return the address of the value. */
+static jstream_t jstream_write_key(jstream_writer_t w, jstream_t obj)
+{
+    if (jstream_str(obj, NULL) == NULL) longjmp(w->env, ERR_VALUE);
+    obj = jstream_write_scalar(w, obj);
+    if (w->indent != 0) jstream_put(w, ": ", 2);
+    else jstream_putc(w, ':');
+    return obj;
+}
+
+/** Push obj onto the stack of the open containers of w. */
+static void jstream_write_open(jstream_writer_t w, jstream_t obj)
+{
+    if (w->depth == w->stack_capacity) {
+        // the stack outgrows w->stack0: it is moved to the heap
+        unsigned cap = 2 * w->stack_capacity;
+        size_t size = cap * sizeof(struct jstream_frame_s);
+        struct jstream_frame_s *stack = w->stack != w->stack0
+            ? (w->mem_realloc == NULL ? realloc(w->stack, size)
+                : w->mem_realloc(w->mem_user, w->stack, size))
+            : (w->mem_alloc == NULL ? malloc(size)
+                : w->mem_alloc(w->mem_user, size));
+        if (stack == NULL) longjmp(w->env, ERR_MEMORY);
+        if (w->stack == w->stack0) memcpy(stack, w->stack0, sizeof(w->stack0));
+        w->stack = stack;
+        w->stack_capacity = cap;
+    }
+    w->stack[w->depth].obj = obj;
+    w->stack[w->depth ++].left = obj[1];
+}
+
+/** Write the value obj into the buffer of w, without recursion:
+    the open arrays and objects are kept in w->stack. */
+static jstream_t jstream_write_value(jstream_writer_t w, jstream_t obj)
+{
+    for (;;) {
+        unsigned code = obj[0];
+        if (code != ARRAY && code != OBJECT) {
+            obj = jstream_write_scalar(w, obj);
+        } else if (obj[1] == 0) {
+            jstream_put(w, code == ARRAY ? "[]" : "{}", 2);
+            obj += obj[2];
+        } else {
+            jstream_putc(w, code == ARRAY ? '[' : '{');
+            jstream_write_open(w, obj);
+            if (w->indent != 0) jstream_newline(w);
+            obj += code == ARRAY ? 3 : 4;
+            if (code == OBJECT) obj = jstream_write_key(w, obj);
+            continue;
+        }
+        /* The value is over: close the containers whose items
+            are over, until one has another item. */
+        for (;;) {
+            if (w->depth == 0) return obj;
+            struct jstream_frame_s *f = w->stack + w->depth - 1;
+            if (-- f->left > 0) {
+                jstream_putc(w, ',');
+                if (w->indent != 0) jstream_newline(w);
+                if (f->obj[0] == OBJECT) obj = jstream_write_key(w, obj);
+                break;
+            }
+            // the hash table of an object may follow its members
+            code = f->obj[0];
+            obj = f->obj + f->obj[2];
+            -- w->depth;
+            if (w->indent != 0) jstream_newline(w);
+            jstream_putc(w, code == ARRAY ? ']' : '}');
+        }
     }
+}
+
+/** The write function used by jstream_dump. */
+static size_t jstream_fwrite(void *ctx, const char *s, size_t n)
+{
+    return fwrite(s, 1, n, ctx);
+}
+
+/* *** PUBLIC STUFF *** */
+
+/** Release p->stack, if it has been moved to the heap. */
+static void jstream_stack_free(jstream_param_t p)
+{
+    if (p->stack != p->stack0) {
+        if (p->mem_free == NULL) free(p->stack);
+        else p->mem_free(p->mem_user, p->stack);
+    }
+    if (p->levels != p->levels0 && p->levels != NULL) {
+        if (p->mem_free == NULL) free(p->levels);
+        else p->mem_free(p->mem_user, p->levels);
+    }
+    p->stack = p->stack0;
+    p->levels = p->levels0;
+    p->stack_capacity = JSTREAM_DEPTH;
+}
+
+/** Parse a value from the input described by p->base, p->cur
+    and p->end (and by the callbacks in *p): this is the common
+    part of jstream, jstream_parse_buffer and jstream_next_document.
+    If first is 0, the value starts with p->clast, which follows
+    the previous one; else the input is scanned from its start. */
+static jstream_t jstream_parse_value(jstream_param_t p, int first)
+{
+    if (!p->reuse && !p->append) {
+        p->obj = NULL;
+        p->capacity = 0;
+    }
+    if (!p->append) p->size = 0;
+    if (p->size == 0) jstream_dict_clear(p);    // a new block
+    unsigned start = p->size;
+    if (first) {
+        p->clast = -1;
+        jstream_kernels(p);
+    }
+    p->stack = p->stack0;
+    p->levels = p->levels0;
+    p->stack_capacity = JSTREAM_DEPTH;
+    p->depth = 0;
+    if ((p->error = setjmp(p->env)) == ERR_NONE) {
+        if (first) jstream_next(p);     // jstream_value expect this
+        else if (p->clast < 0) longjmp(p->env, ERR_END);
+        jstream_value(p);
+        jstream_stack_free(p);
+        // clast has been consumed, but it follows the value
+        if (p->base != NULL) p->offset = p->cur - p->base - (p->clast >= 0);
+        if (p->handler != NULL) {
+            // p->obj has only been used as a scratch area
+            if (!p->reuse && !p->append) jstream_drop(p);
+            return NULL;
+        }
+        if (!p->reuse && !p->append && !p->noshrink && p->size < p->capacity) {
+            // a failure here is harmless: the block stays larger
+            jstream_t objnew = jstream_realloc(p, p->obj,
+                p->size * sizeof(unsigned));
+            if (objnew != NULL) {
+                p->obj = objnew;
+                p->capacity = p->size;
+            }
+        }
+        return p->obj + start;
+    }
+    if (p->base != NULL) p->offset = p->cur - p->base;
+    jstream_stack_free(p);
+    jstream_dict_clear(p);  // it may refer to the dropped value
+    if (!p->reuse && !p->append) jstream_drop(p);
+    p->size = start;
     return NULL;
 }
 
+/** Same as jstream_parse_value, also timing the parsing and
+    counting the characters consumed if statistics are kept. */
+static jstream_t jstream_parse(jstream_param_t p, int first)
+{
+#ifdef JSTREAM_STATS
+    struct jstream_stats_s *stats = p->stats;
+    if (stats != NULL) {
+        struct timespec t0, t1;
+        timespec_get(&t0, TIME_UTC);
+        // the characters left in the input buffer, unless read again
+        stats->bytes += p->end - p->cur;
+        jstream_t obj = jstream_parse_value(p, first);
+        stats->bytes -= p->end - p->cur;
+        timespec_get(&t1, TIME_UTC);
+        stats->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+        return obj;
+    }
+#endif
+    return jstream_parse_value(p, first);
+}
+
+jstream_t jstream(jstream_param_t p)
+{
+    p->base = p->cur = p->end = p->text = NULL;
+    return jstream_parse(p, 1);
+}
+
+jstream_t jstream_next_document(jstream_param_t p)
+{
+    return jstream_parse(p, 0);
+}
+
+jstream_t jstream_parse_buffer(jstream_param_t p, const char *s, size_t n)
+{
+    p->base = p->cur = s;
+    p->end = s + n;
+    p->text = p->refs && p->handler == NULL ? s : NULL;
+    return jstream_parse(p, 1);
+}
+
+jstream_t jstream_parse_file(jstream_param_t p, const char *name)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        if (!p->reuse && !p->append) jstream_drop(p);
+        p->error = ERR_FILE;
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return jstream_parse_buffer(p, "", 0);
+    }
+    void *s = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        if (!p->reuse && !p->append) jstream_drop(p);
+        p->error = ERR_FILE;
+        return NULL;
+    }
+    madvise(s, st.st_size, MADV_SEQUENTIAL);
+    jstream_t obj = jstream_parse_buffer(p, s, st.st_size);
+    /* The file stays mapped, since jstream_next_document goes on
+        reading it and STRING_REF values refer to it: it is unmapped
+        by jstream_free or by the next call. */
+    jstream_unmap(&p->map, &p->map_size);
+    p->map = s;
+    p->map_size = st.st_size;
+    return obj;
+#else
+    // No mmap: the file is read as a stream via fread
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        if (!p->reuse && !p->append) jstream_drop(p);
+        p->error = ERR_FILE;
+        return NULL;
+    }
+    size_t (*read)(void *, char *, size_t) = p->read;
+    void *ctx = p->ctx;
+    p->read = jstream_fread;
+    p->ctx = f;
+    jstream_t obj = jstream(p);
+    p->read = read;
+    p->ctx = ctx;
+    fclose(f);
+    return obj;
+#endif
+}
+
+/* *** SAVED BLOCKS *** */
+
+/** Magic, with the format version, of the files of jstream_save. */
+static const char jstream_magic[8] = "JSTREAM\1";
+
+/** Header of the files of jstream_save. */
+struct jstream_header_s {
+    char magic[8];      ///< jstream_magic
+    uint32_t order;     ///< 0x01020304, in the byte order of the machine
+    uint32_t word;      ///< sizeof(unsigned)
+    uint64_t words;     ///< number of words of the value
+    uint32_t pad;       ///< words between the header and the value
+    uint32_t reserved;  ///< 0
+    uint64_t checksum;  ///< jstream_checksum of the value
+};
+
+/** Return a checksum of the n words at w, computed 8 bytes at a
+    time (a FNV-1a variant on 64 bits words). */
+static uint64_t jstream_checksum(const unsigned *w, size_t n)
+{
+    const unsigned char *s = (const unsigned char*) w;
+    size_t size = n * sizeof(unsigned), i = 0;
+    uint64_t h = 14695981039346656037u;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t x;
+        memcpy(&x, s + i, 8);
+        h = (h ^ x) * 1099511628211u;
+        h ^= h >> 29;
+    }
+    for (; i < size; ++ i) h = (h ^ s[i]) * 1099511628211u;
+    return h;
+}
+
+/** An array or an object being checked by jstream_check: its
+    items end at end, while lim and left are the ones of the
+    container which contains it. */
+struct jstream_check_s {
+    jstream_t obj;
+    jstream_t lim;
+    size_t left;
+};
+
+/** Number of words taken by a STRING of n characters. */
+static size_t jstream_string_words(unsigned n)
+{
+    return 2 + ((size_t) n + sizeof(unsigned)) / sizeof(unsigned);
+}
+
+/** Check the hash table of the indexed object obj, whose members
+    end at obj + obj[3]: it must fit the span of obj, have a free
+    slot, and contain the offsets of its keys and nothing else. */
+static int jstream_check_index(jstream_t obj)
+{
+    jstream_t table = obj + obj[3];
+    unsigned m = table[0], n = obj[1], used = 0;
+    if (obj[2] - obj[3] < 1 || m <= n || (m & (m - 1)) != 0
+        || m > obj[2] - obj[3] - 1)
+        return ERR_FORMAT;
+    for (unsigned j = 0; j < m; ++ j) used += table[1 + j] != 0;
+    if (used != n) return ERR_FORMAT;
+    jstream_t key = obj + 4;
+    for (unsigned i = 0; i < n; ++ i) {
+        unsigned j = jstream_hash_key(jstream_str(key, NULL), key[1]) & (m - 1);
+        while (table[1 + j] != 0 && obj + table[1 + j] != key) j = (j + 1) & (m - 1);
+        if (table[1 + j] == 0) return ERR_FORMAT;
+        key = jstream_skip(jstream_skip(key));
+    }
+    return ERR_NONE;
+}
+
+/** Check that the words in [obj, end) are a single value, which
+    can be read by jstream_skip, jstream_get and the other
+    functions without leaving them: codes, lengths, spans, hash
+    tables of objects, alignment of packed arrays, and SYMBOL
+    values, which must refer to a string between obj and
+    themselves. Return ERR_NONE, or ERR_VALUE if the value
+    contains STRING_REF values (whose addresses can't be saved),
+    ERR_FORMAT if it is not valid, ERR_MEMORY if memory is
+    exhausted. The value is walked item by item, without
+    recursion. */
+static int jstream_check(jstream_t obj, jstream_t end)
+{
+    struct jstream_check_s stack0[JSTREAM_DEPTH], *stack = stack0;
+    size_t depth = 0, cap = JSTREAM_DEPTH, left = 1;
+    jstream_t v = obj, lim = end;
+    int r = ERR_NONE;
+    while (r == ERR_NONE) {
+        if (left == 0) {
+            // the items of the container (or the value) fill it
+            if (v != lim) {
+                r = ERR_FORMAT;
+                break;
+            }
+            if (depth == 0) break;
+            struct jstream_check_s *c = stack + -- depth;
+            if (c->obj[0] == OBJECT && c->obj[3] != 0) r = jstream_check_index(c->obj);
+            v = c->obj + c->obj[2];
+            lim = c->lim;
+            left = c->left;
+            continue;
+        }
+        size_t room = lim - v;
+        // keys of objects are strings
+        int key = depth > 0 && stack[depth - 1].obj[0] == OBJECT && left % 2 == 0;
+        -- left;
+        if (room == 0 || (key && v[0] != STRING && v[0] != SYMBOL)) {
+            r = ERR_FORMAT;
+            break;
+        }
+        switch (v[0]) {
+            case 0 /* NULL */: case FALSE: case TRUE:
+                ++ v;
+                break;
+            case NUMBER: case INTEGER:
+                if (room < 1 + sizeof(double)/sizeof(unsigned)) r = ERR_FORMAT;
+                else v += 1 + sizeof(double)/sizeof(unsigned);
+                break;
+            case STRING:
+                if (room < 2 || room < jstream_string_words(v[1])) r = ERR_FORMAT;
+                else v += jstream_string_words(v[1]);
+                break;
+            case STRING_REF:
+                r = ERR_VALUE;
+                break;
+            case SYMBOL: {
+                jstream_t t = v - v[2];
+                if (room < 3 || v[2] == 0 || v[2] > (size_t) (v - obj)
+                    || t[0] != STRING || t[1] != v[1]
+                    || v[2] < jstream_string_words(t[1]))
+                    r = ERR_FORMAT;
+                else
+                    v += 3;
+                break;
+            }
+            case ARRAY: case OBJECT: {
+                unsigned h = v[0] == OBJECT ? 4 : 3;
+                if (room < h || v[2] < h || v[2] > room
+                    || (h == 4 && v[3] != 0 && (v[3] < h || v[3] > v[2]))) {
+                    r = ERR_FORMAT;
+                    break;
+                }
+                if (depth == cap) {
+                    struct jstream_check_s *s = depth > SIZE_MAX / 2 / sizeof(*s) ? NULL
+                        : realloc(stack == stack0 ? NULL : stack, 2 * cap * sizeof(*s));
+                    if (s == NULL) {
+                        r = ERR_MEMORY;
+                        break;
+                    }
+                    if (stack == stack0) memcpy(s, stack0, sizeof(stack0));
+                    stack = s;
+                    cap *= 2;
+                }
+                struct jstream_check_s *c = stack + depth ++;
+                c->obj = v;
+                c->lim = lim;
+                c->left = left;
+                lim = v + (h == 4 && v[3] != 0 ? v[3] : v[2]);
+                left = h == 4 ? 2 * (size_t) v[1] : v[1];
+                v += h;
+                break;
+            }
+            case ARRAY_F64: case ARRAY_I64:
+                // the elements are aligned to 8 bytes
+                if (room < 4 || v[2] > room || v[3] < 4 || v[3] > v[2]
+                    || (v[2] - v[3]) / (sizeof(double)/sizeof(unsigned)) < v[1]
+                    || (uintptr_t) (v + v[3]) % 8 != 0)
+                    r = ERR_FORMAT;
+                else
+                    v += v[2];
+                break;
+            default:
+                r = ERR_FORMAT;
+        }
+    }
+    if (stack != stack0) free(stack);
+    return r;
+}
+
+int jstream_save(jstream_t obj, const char *name)
+{
+    jstream_t end = jstream_skip(obj);
+    if (end == NULL) return ERR_VALUE;
+    int r = jstream_check(obj, end);
+    if (r != ERR_NONE) return r == ERR_MEMORY ? r : ERR_VALUE;
+    struct jstream_header_s h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, jstream_magic, sizeof(h.magic));
+    h.order = 0x01020304;
+    h.word = sizeof(unsigned);
+    h.words = end - obj;
+    h.pad = (uintptr_t) obj % 8 / sizeof(unsigned);
+    h.checksum = jstream_checksum(obj, h.words);
+    static const unsigned pad[2];
+    FILE *f = fopen(name, "wb");
+    if (f == NULL) return ERR_FILE;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(pad, sizeof(unsigned), h.pad, f) == h.pad
+        && fwrite(obj, sizeof(unsigned), h.words, f) == h.words;
+    return fclose(f) == 0 && ok ? ERR_NONE : ERR_FILE;
+}
+
+jstream_t jstream_load(jstream_param_t p, const char *name)
+{
+    jstream_unmap(&p->image, &p->image_size);
+    size_t size;
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    p->error = fd < 0 || fstat(fd, &st) != 0 ? ERR_FILE
+        : st.st_size < (off_t) sizeof(struct jstream_header_s) ? ERR_FORMAT : ERR_NONE;
+    if (p->error != ERR_NONE) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    void *s = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        p->error = ERR_FILE;
+        return NULL;
+    }
+#else
+    // No mmap: the file is read into memory
+    FILE *f = fopen(name, "rb");
+    void *s = NULL;
+    if (f != NULL && fseek(f, 0, SEEK_END) == 0 && (long) (size = ftell(f)) >= 0
+        && fseek(f, 0, SEEK_SET) == 0 && (s = malloc(size + 1)) != NULL
+        && fread(s, 1, size, f) != size) {
+        free(s);
+        s = NULL;
+    }
+    if (f != NULL) fclose(f);
+    if (s == NULL) {
+        p->error = ERR_FILE;
+        return NULL;
+    }
+#endif
+    p->image = s;
+    p->image_size = size;
+    // the header, then the word at the start of the value
+    struct jstream_header_s h;
+    memcpy(&h, s, sizeof(h));
+    jstream_t obj = (jstream_t)((char*) s + sizeof(h)) + h.pad;
+    p->error = memcmp(h.magic, jstream_magic, sizeof(h.magic)) != 0
+        || h.order != 0x01020304 || h.word != sizeof(unsigned) || h.pad > 1
+        || (size - sizeof(h)) % sizeof(unsigned) != 0
+        || (size - sizeof(h)) / sizeof(unsigned) < h.pad
+        || h.words != (size - sizeof(h)) / sizeof(unsigned) - h.pad
+        || h.words == 0 ? ERR_FORMAT : ERR_NONE;
+    if (p->error == ERR_NONE && !p->trust) {
+        // a corrupted file must not make the readers go astray
+        if (jstream_checksum(obj, h.words) != h.checksum) p->error = ERR_FORMAT;
+        else p->error = jstream_check(obj, obj + h.words);
+        if (p->error == ERR_VALUE) p->error = ERR_FORMAT;
+    }
+    if (p->error != ERR_NONE) {
+        jstream_unmap(&p->image, &p->image_size);
+        return NULL;
+    }
+    return obj;
+}
+
+/* *** BUILDER *** */
+
+/** Check that an item, which is a key if key is not 0, can be
+    added to the value being built by p, and count it in the
+    innermost open container: return 0 if it can, else set
+    p->error (unless it has been already set). */
+static inline int jstream_build_item(jstream_param_t p, int key)
+{
+    if (p->error != ERR_NONE) return 0;
+    if (p->depth == 0) {
+        // only one value at top level
+        if (key || p->size > p->build_start) p->error = ERR_VALUE;
+        return p->error == ERR_NONE;
+    }
+    unsigned ilen = p->stack[p->depth - 1];
+    if (p->obj[ilen - 1] == ARRAY) {
+        if (key) p->error = ERR_VALUE;
+        else ++ p->obj[ilen];
+    } else if (key == p->build_key) {
+        // a key where a value is expected, or vice versa
+        p->error = key ? ERR_VALUE : ERR_KEY;
+    } else {
+        p->obj[ilen] += key;
+        p->build_key = key;
+    }
+    return p->error == ERR_NONE;
+}
+
+/** Same as jstream_grow, but in case of error set p->error and
+    return 0. */
+static int jstream_build_grow(jstream_param_t p, unsigned n)
+{
+    if ((p->error = setjmp(p->env)) != ERR_NONE) return 0;
+    jstream_grow(p, n);
+    return 1;
+}
+
+/** Same as jstream_expand, but in case of error set p->error
+    and return NULL. */
+static inline jstream_t jstream_build_expand(jstream_param_t p, unsigned n)
+{
+    // only growing may fail
+    if (n > p->capacity - p->size && !jstream_build_grow(p, n)) return NULL;
+    return jstream_expand(p, n);
+}
+
+void jstream_build_begin(jstream_param_t p)
+{
+    if (!p->reuse && !p->append) {
+        p->obj = NULL;
+        p->capacity = 0;
+    }
+    if (!p->append) p->size = 0;
+    if (p->size == 0) jstream_dict_clear(p);    // a new block
+    p->build_start = p->size;
+    p->build_key = 0;
+    p->stack = p->stack0;
+    p->stack_capacity = JSTREAM_DEPTH;
+    p->depth = 0;
+    p->error = ERR_NONE;
+}
+
+jstream_t jstream_build_end(jstream_param_t p)
+{
+    size_t start = p->build_start;
+    if (p->error == ERR_NONE && p->depth > 0) p->error = ERR_CLOSED_BRACKET;
+    if (p->error == ERR_NONE && p->size == start) p->error = ERR_END;
+    jstream_stack_free(p);
+    if (p->error != ERR_NONE) {
+        jstream_dict_clear(p);  // it may refer to the dropped value
+        if (!p->reuse && !p->append) jstream_drop(p);
+        p->size = start;
+        return NULL;
+    }
+    if (!p->reuse && !p->append && !p->noshrink && p->size < p->capacity) {
+        // a failure here is harmless: the block stays larger
+        jstream_t objnew = jstream_realloc(p, p->obj, p->size * sizeof(unsigned));
+        if (objnew != NULL) {
+            p->obj = objnew;
+            p->capacity = p->size;
+        }
+    }
+    return p->obj + start;
+}
+
+/** Open an array or an object, as code says. */
+static int jstream_build_open(jstream_param_t p, unsigned code)
+{
+    if (!jstream_build_item(p, 0)) return p->error;
+    if (p->depth == p->max_depth && p->max_depth != 0)
+        return p->error = ERR_DEPTH;
+    if (p->depth == p->stack_capacity) {
+        if ((p->error = setjmp(p->env)) != ERR_NONE) return p->error;
+        jstream_stack_grow(p);
+    }
+    jstream_t objnew = jstream_build_expand(p, code == ARRAY ? 3 : 4);
+    if (objnew == NULL) return p->error;
+    objnew[0] = code;
+    objnew[1] = 0;
+    if (code == OBJECT) objnew[3] = 0;
+    p->stack[p->depth ++] = objnew + 1 - p->obj;
+    p->build_key = 0;
+    return ERR_NONE;
+}
+
+/** Close the innermost open container, which must be an array
+    or an object, as code says. */
+static int jstream_build_close(jstream_param_t p, unsigned code)
+{
+    if (p->error != ERR_NONE) return p->error;
+    if (p->depth == 0 || p->obj[p->stack[p->depth - 1] - 1] != code)
+        return p->error = ERR_CLOSED_BRACKET;
+    if (p->build_key) return p->error = ERR_VALUE;  // a key without value
+    if ((p->error = setjmp(p->env)) != ERR_NONE) return p->error;
+    jstream_seal(p, p->stack[-- p->depth]);
+    return ERR_NONE;
+}
+
+int jstream_begin_array(jstream_param_t p)
+{
+    return jstream_build_open(p, ARRAY);
+}
+
+int jstream_end_array(jstream_param_t p)
+{
+    return jstream_build_close(p, ARRAY);
+}
+
+int jstream_begin_object(jstream_param_t p)
+{
+    return jstream_build_open(p, OBJECT);
+}
+
+int jstream_end_object(jstream_param_t p)
+{
+    return jstream_build_close(p, OBJECT);
+}
+
+/** Add a string of n characters, which is a key if key is not
+    0, interning it as p says. */
+static int jstream_build_string(jstream_param_t p, const char *s, size_t n, int key)
+{
+    if (n >= UINT_MAX - sizeof(unsigned)) return p->error = ERR_MEMORY;
+    if (!jstream_build_item(p, key)) return p->error;
+    size_t i = p->size;
+    unsigned words = 2 + jstream_align(n + 1);
+    jstream_t objnew = jstream_build_expand(p, words);
+    if (objnew == NULL) return p->error;
+    objnew[0] = STRING;
+    objnew[1] = n;
+    objnew[words - 1] = 0;  // the '\0' and the padding
+    memcpy(objnew + 2, s, n);
+    if (key ? p->intern : p->intern_values != 0 && n <= p->intern_values) {
+        if ((p->error = setjmp(p->env)) != ERR_NONE) return p->error;
+        jstream_intern(p, i);
+    }
+    return ERR_NONE;
+}
+
+int jstream_add_key(jstream_param_t p, const char *s, size_t n)
+{
+    return jstream_build_string(p, s, n, 1);
+}
+
+int jstream_add_string(jstream_param_t p, const char *s, size_t n)
+{
+    return jstream_build_string(p, s, n, 0);
+}
+
+int jstream_add_number(jstream_param_t p, double d)
+{
+    if (!jstream_build_item(p, 0)) return p->error;
+    jstream_t objnew = jstream_build_expand(p, 1 + sizeof(double)/sizeof(unsigned));
+    if (objnew == NULL) return p->error;
+    objnew[0] = NUMBER;
+    memcpy(objnew + 1, &d, sizeof(d));
+    return ERR_NONE;
+}
+
+int jstream_add_integer(jstream_param_t p, int64_t i)
+{
+    if (!jstream_build_item(p, 0)) return p->error;
+    jstream_t objnew = jstream_build_expand(p, 1 + sizeof(int64_t)/sizeof(unsigned));
+    if (objnew == NULL) return p->error;
+    objnew[0] = INTEGER;
+    memcpy(objnew + 1, &i, sizeof(i));
+    return ERR_NONE;
+}
+
+/** Add a value of a single word, whose code is code. */
+static int jstream_build_code(jstream_param_t p, unsigned code)
+{
+    if (!jstream_build_item(p, 0)) return p->error;
+    jstream_t objnew = jstream_build_expand(p, 1);
+    if (objnew == NULL) return p->error;
+    objnew[0] = code;
+    return ERR_NONE;
+}
+
+int jstream_add_bool(jstream_param_t p, int b)
+{
+    return jstream_build_code(p, b ? TRUE : FALSE);
+}
+
+int jstream_add_null(jstream_param_t p)
+{
+    return jstream_build_code(p, 0);    // NULL
+}
+
+/** States of the scanner of jstream_feed. */
+enum {
+    FEED_SPACE,     ///< before the value
+    FEED_VALUE,     ///< inside arrays or objects, outside strings
+    FEED_STRING,    ///< inside a string
+    FEED_ESCAPE,    ///< inside a string, after a '\\'
+    FEED_SCALAR     ///< inside a number or literal at top level
+};
+
+/** Go on scanning the characters fed to p from p->feed_scan:
+    return nonzero if the value is over, and then p->feed_scan
+    is the offset of the character following it. */
+static int jstream_feed_scan(jstream_param_t p)
+{
+    const char *s = p->feed;
+    size_t i = p->feed_scan, n = p->feed_size;
+    for (; i < n; ++ i) {
+        char c = s[i];
+        switch (p->feed_state) {
+        case FEED_SPACE:
+            if (JSTREAM_ISSPACE(c)) break;
+            p->feed_start = i;
+            p->feed_depth = c == '[' || c == '{';
+            p->feed_state = c == '"' ? FEED_STRING
+                : p->feed_depth > 0 ? FEED_VALUE : FEED_SCALAR;
+            break;
+        case FEED_VALUE:
+            if (c == '"') {
+                p->feed_state = FEED_STRING;
+            } else if (c == '[' || c == '{') {
+                ++ p->feed_depth;
+            } else if ((c == ']' || c == '}') && -- p->feed_depth == 0) {
+                p->feed_scan = i + 1;
+                return 1;
+            }
+            break;
+        case FEED_STRING:
+            // skip the run of characters up to the next '"' or '\\'
+            i = p->scan_quote(s + i, s + n) - s;
+            if (i == n) {
+                p->feed_scan = n;
+                return 0;
+            }
+            if (s[i] == '\\') {
+                p->feed_state = FEED_ESCAPE;
+            } else if (p->feed_depth > 0) {
+                p->feed_state = FEED_VALUE;
+            } else {
+                p->feed_scan = i + 1;
+                return 1;
+            }
+            break;
+        case FEED_ESCAPE:
+            p->feed_state = FEED_STRING;
+            break;
+        case FEED_SCALAR:
+            if (JSTREAM_ISNUM(c) || (c >= 'a' && c <= 'z')) break;
+            p->feed_scan = i;
+            return 1;
+        }
+    }
+    p->feed_scan = n;
+    return 0;
+}
+
+int jstream_feed(jstream_param_t p, const char *s, size_t n)
+{
+    if (p->scan_quote == NULL) jstream_kernels(p);
+    if (p->feed_done > 0) {
+        // drop the characters of the previous value
+        p->feed_size -= p->feed_done;
+        memmove(p->feed, p->feed + p->feed_done, p->feed_size);
+        p->feed_scan -= p->feed_done;
+        p->feed_done = 0;
+    }
+    if (p->feed_size + n > p->feed_capacity) {
+        size_t cap = p->feed_capacity < JSTREAM_BUFSIZE ? JSTREAM_BUFSIZE
+            : 2 * p->feed_capacity;
+        if (cap < p->feed_size + n) cap = p->feed_size + n;
+        char *feed = jstream_realloc(p, p->feed, cap);
+        if (feed == NULL) {
+            p->error = ERR_MEMORY;
+            return FEED_ERROR;
+        }
+        p->feed = feed;
+        p->feed_capacity = cap;
+    }
+    if (n > 0) memcpy(p->feed + p->feed_size, s, n);
+    p->feed_size += n;
+    int over = jstream_feed_scan(p);
+    if (!over && s == NULL && n == 0) {
+        // the input is over
+        if (p->feed_state != FEED_SCALAR) {
+            p->error = p->feed_state == FEED_SPACE ? ERR_END
+                : p->feed_state == FEED_VALUE ? ERR_CLOSED_BRACKET
+                : ERR_EOS_INSIDE_STRING;
+            p->feed_state = FEED_SPACE;
+            p->feed_done = p->feed_scan;
+            return FEED_ERROR;
+        }
+        over = 1;
+    }
+    if (!over) return FEED_NEED_MORE;
+    p->feed_state = FEED_SPACE;
+    p->feed_done = p->feed_scan;
+    // the strings are copied, since p->feed is reused
+    p->base = p->cur = p->feed + p->feed_start;
+    p->end = p->feed + p->feed_scan;
+    p->text = NULL;
+    jstream_parse(p, 1);
+    return p->error == ERR_NONE ? FEED_DONE : FEED_ERROR;
+}
+
+void jstream_free(jstream_param_t p)
+{
+    jstream_drop(p);
+    jstream_unmap(&p->map, &p->map_size);
+    jstream_unmap(&p->image, &p->image_size);
+    if (p->dict != NULL) {
+        if (p->mem_free == NULL) free(p->dict);
+        else p->mem_free(p->mem_user, p->dict);
+    }
+    p->dict = NULL;
+    p->dict_size = p->dict_capacity = 0;
+    if (p->feed != NULL) {
+        if (p->mem_free == NULL) free(p->feed);
+        else p->mem_free(p->mem_user, p->feed);
+    }
+    p->feed = NULL;
+    p->feed_size = p->feed_capacity = 0;
+    p->feed_scan = p->feed_done = 0;
+    p->feed_state = FEED_SPACE;
+}
+
+jstream_t jstream_dump(FILE *f, jstream_t obj)
+{
+    char buf[4096];
+    struct jstream_writer_s w = {0};
+    w.buf = buf;
+    w.capacity = sizeof(buf);
+    w.write = jstream_fwrite;
+    w.ctx = f;
+    jstream_t next = jstream_write(&w, obj);
+    jstream_flush(&w);
+    if (w.error == ERR_VALUE)
+        fprintf(f, "Invalid object code\n");
+    return next;
+}
+
+jstream_t jstream_write(jstream_writer_t w, jstream_t obj)
+{
+    w->stack = w->stack0;
+    w->stack_capacity = JSTREAM_DEPTH;
+    w->depth = 0;
+    jstream_t volatile next = NULL;
+    if ((w->error = setjmp(w->env)) == ERR_NONE) {
+        next = jstream_write_value(w, obj);
+        if (w->write == NULL) {
+            // the text is followed by a '\0'
+            jstream_putc(w, '\0');
+            -- w->size;
+        }
+    } else {
+        next = NULL;
+    }
+    if (w->stack != w->stack0) {
+        if (w->mem_free == NULL) free(w->stack);
+        else w->mem_free(w->mem_user, w->stack);
+        w->stack = w->stack0;
+    }
+    return next;
+}
+
+int jstream_flush(jstream_writer_t w)
+{
+    if (w->write != NULL && w->size > 0) {
+        if (w->write(w->ctx, w->buf, w->size) != w->size)
+            w->error = ERR_FILE;
+        w->size = 0;
+    }
+    return w->error;
+}
+
+void jstream_write_free(jstream_writer_t w)
+{
+    if (w->own && w->buf != NULL) {
+        if (w->mem_free == NULL) free(w->buf);
+        else w->mem_free(w->mem_user, w->buf);
+    }
+    w->buf = NULL;
+    w->size = 0;
+    w->capacity = 0;
+    w->own = 0;
+}
+
 jstream_t jstream_skip(jstream_t obj)
 {
     switch (obj[0]) {
@@ -416,22 +2675,589 @@ jstream_t jstream_skip(jstream_t obj)
             return obj + 1;
         case NUMBER:
             return obj + 1 + sizeof(double)/sizeof(unsigned);
+        case INTEGER:
+            return obj + 1 + sizeof(int64_t)/sizeof(unsigned);
         case STRING:
-            return obj + 1 + jstream_align(strlen((char*)(obj + 1)) + 1);
-        case ARRAY: {
-            jstream_t next = obj + 2;
-            for (unsigned i = 0; i < obj[1]; ++ i) {
-                next = jstream_skip(next);
+            return obj + 2 + jstream_align(obj[1] + 1);
+        case STRING_REF:
+            return obj + 2 + sizeof(char*)/sizeof(unsigned);
+        case SYMBOL:
+            return obj + 3;
+        case ARRAY: case OBJECT: case ARRAY_F64: case ARRAY_I64:
+            return obj + obj[2];
+    }
+    return NULL;
+}
+
+jstream_t jstream_get(jstream_t obj, const char *key)
+{
+    return jstream_get_key(obj, key, strlen(key));
+}
+
+jstream_t jstream_get_key(jstream_t obj, const char *key, size_t len)
+{
+    if (obj[0] != OBJECT) return NULL;
+    if (obj[3] != 0) {
+        jstream_t table = obj + obj[3];
+        unsigned m = table[0];
+        unsigned j = jstream_hash_key(key, len) & (m - 1);
+        for (; table[1 + j] != 0; j = (j + 1) & (m - 1)) {
+            jstream_t k = obj + table[1 + j];
+            if (k[1] == len && memcmp(jstream_str(k, NULL), key, len) == 0)
+                return jstream_skip(k);
+        }
+        return NULL;
+    }
+    jstream_t k = obj + 4;
+    for (unsigned i = 0; i < obj[1]; ++ i) {
+        if (k[1] == len && memcmp(jstream_str(k, NULL), key, len) == 0)
+            return jstream_skip(k);
+        k = jstream_skip(jstream_skip(k));
+    }
+    return NULL;
+}
+
+const char *jstream_str(jstream_t v, unsigned *len)
+{
+    if (v[0] == SYMBOL) v -= v[2];
+    if (v[0] != STRING && v[0] != STRING_REF) return NULL;
+    if (len != NULL) *len = v[1];
+    return v[0] == STRING ? (const char*)(v + 2) : *(const char**)(v + 2);
+}
+
+const double *jstream_f64(jstream_t v, unsigned *n)
+{
+    if (v[0] != ARRAY_F64) return NULL;
+    if (n != NULL) *n = v[1];
+    return (const double*)(v + v[3]);
+}
+
+const int64_t *jstream_i64(jstream_t v, unsigned *n)
+{
+    if (v[0] != ARRAY_I64) return NULL;
+    if (n != NULL) *n = v[1];
+    return (const int64_t*)(v + v[3]);
+}
+
+jstream_t jstream_symbol(jstream_t v)
+{
+    return v[0] == SYMBOL ? v - v[2] : v;
+}
+
+jstream_t jstream_get_symbol(jstream_t obj, jstream_t key)
+{
+    if (obj[0] != OBJECT) return NULL;
+    key = jstream_symbol(key);
+    if (obj[3] != 0) {
+        jstream_t table = obj + obj[3];
+        unsigned m = table[0];
+        unsigned j = jstream_hash_key(jstream_str(key, NULL), key[1]) & (m - 1);
+        for (; table[1 + j] != 0; j = (j + 1) & (m - 1)) {
+            jstream_t k = obj + table[1 + j];
+            if (jstream_symbol(k) == key) return jstream_skip(k);
+        }
+        return NULL;
+    }
+    jstream_t k = obj + 4;
+    for (unsigned i = 0; i < obj[1]; ++ i) {
+        if (jstream_symbol(k) == key) return jstream_skip(k);
+        k = jstream_skip(jstream_skip(k));
+    }
+    return NULL;
+}
+
+/* *** COMPARISON *** */
+
+/** A number in canonical form: integral values, either of INTEGER
+    items or of doubles which fit an int64_t, are in i, the other
+    ones in d, so that a number compares and hashes the same
+    however it is stored. */
+struct jstream_num_s {
+    int integral;
+    int64_t i;
+    double d;
+};
+
+static struct jstream_num_s jstream_num_double(double d)
+{
+    struct jstream_num_s n = {0, 0, d};
+    if (d >= -9223372036854775808.0 && d < 9223372036854775808.0
+        && (double) (int64_t) d == d) {
+        n.integral = 1;
+        n.i = (int64_t) d;
+    }
+    return n;
+}
+
+static struct jstream_num_s jstream_num_int(int64_t i)
+{
+    struct jstream_num_s n = {1, i, 0};
+    return n;
+}
+
+/** Canonical form of the NUMBER or INTEGER value v. */
+static struct jstream_num_s jstream_num(jstream_t v)
+{
+    return v[0] == INTEGER ? jstream_num_int(*(int64_t*)(v + 1))
+        : jstream_num_double(*(double*)(v + 1));
+}
+
+/** Canonical form of the i-th element of the packed array v. */
+static struct jstream_num_s jstream_packed_num(jstream_t v, unsigned i)
+{
+    return v[0] == ARRAY_I64 ? jstream_num_int(jstream_i64(v, NULL)[i])
+        : jstream_num_double(jstream_f64(v, NULL)[i]);
+}
+
+static int jstream_num_equal(struct jstream_num_s a, struct jstream_num_s b)
+{
+    return a.integral ? b.integral && a.i == b.i : !b.integral && a.d == b.d;
+}
+
+/** Return the code of v up to the way it is stored: NUMBER for
+    INTEGER, STRING for STRING_REF and SYMBOL, ARRAY for packed
+    arrays, or -1 if v is not valid. */
+static int jstream_kind(jstream_t v)
+{
+    switch (v[0]) {
+        case 0 /* NULL */: case FALSE: case TRUE: case NUMBER:
+        case STRING: case ARRAY: case OBJECT:
+            return (int) v[0];
+        case INTEGER:
+            return NUMBER;
+        case STRING_REF: case SYMBOL:
+            return STRING;
+        case ARRAY_F64: case ARRAY_I64:
+            return ARRAY;
+    }
+    return -1;
+}
+
+/** Return nonzero if the string values a and b have the same
+    characters. */
+static int jstream_str_equal(jstream_t a, jstream_t b)
+{
+    unsigned m = 0, n = 0;
+    const char *s = jstream_str(a, &m), *t = jstream_str(b, &n);
+    return m == n && memcmp(s, t, m) == 0;
+}
+
+/** Return nonzero if the arrays a and b, one of which at least is
+    packed, have the same number of elements, and equal ones. */
+static int jstream_packed_equal(jstream_t a, jstream_t b)
+{
+    if (a[0] == ARRAY) {
+        jstream_t t = a;
+        a = b;
+        b = t;
+    }
+    if (a[1] != b[1]) return 0;
+    jstream_t e = b + 3;
+    for (unsigned i = 0; i < a[1]; ++ i) {
+        if (b[0] != ARRAY) {
+            if (!jstream_num_equal(jstream_packed_num(a, i), jstream_packed_num(b, i)))
+                return 0;
+            continue;
+        }
+        if (jstream_kind(e) != NUMBER
+            || !jstream_num_equal(jstream_packed_num(a, i), jstream_num(e)))
+            return 0;
+        e = jstream_skip(e);
+    }
+    return 1;
+}
+
+/** Return nonzero if the objects a and b, with the same number of
+    members, have their keys in the same order. */
+static int jstream_same_keys(jstream_t a, jstream_t b)
+{
+    jstream_t k = a + 4, l = b + 4;
+    for (unsigned i = 0; i < a[1]; ++ i) {
+        if (!jstream_str_equal(k, l)) return 0;
+        k = jstream_skip(jstream_skip(k));
+        l = jstream_skip(jstream_skip(l));
+    }
+    return 1;
+}
+
+/** Return nonzero if each key of the object b is also in a. */
+static int jstream_has_keys(jstream_t a, jstream_t b)
+{
+    jstream_t l = b + 4;
+    for (unsigned i = 0; i < b[1]; ++ i) {
+        unsigned n;
+        const char *s = jstream_str(l, &n);
+        if (jstream_get_key(a, s, n) == NULL) return 0;
+        l = jstream_skip(jstream_skip(l));
+    }
+    return 1;
+}
+
+/** Return the number of the members of the object obj preceding
+    the one whose key is at k and having the same key. */
+static unsigned jstream_key_rank(jstream_t obj, jstream_t k)
+{
+    unsigned n, r = 0;
+    const char *s = jstream_str(k, &n);
+    for (jstream_t l = obj + 4; l < k; l = jstream_skip(jstream_skip(l))) {
+        unsigned m;
+        const char *t = jstream_str(l, &m);
+        r += m == n && memcmp(s, t, n) == 0;
+    }
+    return r;
+}
+
+/** Same as jstream_get_key, but return the value of the r-th
+    member (counting from 0) having the key. */
+static jstream_t jstream_get_nth(jstream_t obj, const char *key, unsigned len, unsigned r)
+{
+    jstream_t l = obj + 4;
+    for (unsigned i = 0; i < obj[1]; ++ i) {
+        unsigned m;
+        const char *t = jstream_str(l, &m);
+        l = jstream_skip(l);
+        if (m == len && memcmp(key, t, len) == 0 && r -- == 0) return l;
+        l = jstream_skip(l);
+    }
+    return NULL;
+}
+
+/** Double the capacity *cap of a stack of items of size bytes,
+    which is stack0 until it is first enlarged: return its new
+    address, or NULL if there is no memory. */
+static void *jstream_grow_stack(void *stack, void *stack0, unsigned *cap, size_t size)
+{
+    if (*cap > UINT_MAX / 2) return NULL;
+    void *s = realloc(stack == stack0 ? NULL : stack, 2 * (size_t) *cap * size);
+    if (s == NULL) return NULL;
+    if (stack == stack0) memcpy(s, stack0, *cap * size);
+    *cap *= 2;
+    return s;
+}
+
+/** Two arrays or objects being compared by jstream_equal: the
+    left items following a are compared with the ones following
+    b or, if lookup is not 0, the left members following a in the
+    object obj with the values of the same keys in the object b,
+    the r-th member with a key in obj being compared with the r-th
+    one with that key in b. */
+struct jstream_pair_s {
+    jstream_t a, b;
+    unsigned left;
+    int lookup;
+    jstream_t obj;
+};
+
+int jstream_equal(jstream_t a, jstream_t b, int unordered)
+{
+    struct jstream_pair_s stack0[JSTREAM_DEPTH], *stack = stack0;
+    unsigned depth = 0, cap = JSTREAM_DEPTH;
+    int r;
+    for (;;) {
+        int kind = jstream_kind(a);
+        if (kind < 0 || kind != jstream_kind(b)) r = 0;
+        else if (kind == NUMBER) r = jstream_num_equal(jstream_num(a), jstream_num(b));
+        else if (kind == STRING) r = jstream_str_equal(a, b);
+        else if (kind == ARRAY && (a[0] != ARRAY || b[0] != ARRAY))
+            r = jstream_packed_equal(a, b);
+        else if (kind != ARRAY && kind != OBJECT) r = 1;
+        else if (a[1] != b[1]) r = 0;
+        else if (a[1] > 0) {
+            struct jstream_pair_s f = {a + 3, b + 3, a[1], 0, NULL};
+            r = 1;
+            if (kind == OBJECT) {
+                // in the same order, members are compared as items
+                f.a = a + 4;
+                f.b = b + 4;
+                f.left = 2 * a[1];
+                if (!jstream_same_keys(a, b)) {
+                    r = unordered && jstream_has_keys(a, b);
+                    f.b = b;
+                    f.left = a[1];
+                    f.lookup = 1;
+                    f.obj = a;
+                }
+            }
+            if (r && depth == cap) {
+                struct jstream_pair_s *s = jstream_grow_stack(stack, stack0,
+                    &cap, sizeof(*stack));
+                if (s == NULL) r = -1;
+                else stack = s;
             }
-            return next;
+            if (r == 1) stack[depth ++] = f;
+        } else {
+            r = 1;
         }
-        case OBJECT: {
-            jstream_t next = obj + 2;
-            for (unsigned i = 0; i < obj[1]; ++ i) {
-                next = jstream_skip(jstream_skip(next));
+        if (r != 1) break;
+        // next pair of items
+        while (depth > 0 && stack[depth - 1].left == 0) -- depth;
+        if (depth == 0) break;
+        struct jstream_pair_s *f = stack + depth - 1;
+        -- f->left;
+        a = f->a;
+        if (f->lookup) {
+            unsigned n;
+            const char *s = jstream_str(a, &n);
+            jstream_t k = a;
+            a = jstream_skip(a);
+            b = jstream_get_key(f->b, s, n);
+            if (b != NULL && jstream_get_key(f->obj, s, n) != a)
+                // a duplicate key, matched by the order of occurrence
+                b = jstream_get_nth(f->b, s, n, jstream_key_rank(f->obj, k));
+            f->a = jstream_skip(a);
+            if (b == NULL) {
+                r = 0;
+                break;
+            }
+        } else {
+            b = f->b;
+            f->a = jstream_skip(a);
+            f->b = jstream_skip(b);
+        }
+    }
+    if (stack != stack0) free(stack);
+    return r;
+}
+
+/** Mix the bits of h (by the finalizer of splitmix64). */
+static uint64_t jstream_mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9u;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebu;
+    return h ^ (h >> 31);
+}
+
+/** Initial hash of a value of the given kind with n items. */
+static uint64_t jstream_hash_seed(int kind, unsigned n)
+{
+    return jstream_mix(((uint64_t) kind << 32 | n) + 0x9e3779b97f4a7c15u);
+}
+
+static uint64_t jstream_hash_num(struct jstream_num_s n)
+{
+    uint64_t u = (uint64_t) n.i;
+    if (!n.integral) memcpy(&u, &n.d, sizeof(u));
+    return jstream_mix(u ^ jstream_hash_seed(NUMBER, n.integral));
+}
+
+/** Hash of a value which is not an ARRAY or OBJECT with items:
+    the one of a packed array combines the hashes of its elements
+    as the one of an ARRAY does. */
+static uint64_t jstream_hash_item(jstream_t v)
+{
+    int kind = jstream_kind(v);
+    if (kind == NUMBER) return jstream_hash_num(jstream_num(v));
+    if (kind == STRING) {
+        // FNV-1a of the characters
+        unsigned n;
+        const unsigned char *s = (const unsigned char*) jstream_str(v, &n);
+        uint64_t h = jstream_hash_seed(STRING, n);
+        for (unsigned i = 0; i < n; ++ i) h = (h ^ s[i]) * 0x100000001b3u;
+        return jstream_mix(h);
+    }
+    if (kind == ARRAY) {
+        uint64_t h = jstream_hash_seed(ARRAY, v[1]);
+        if (v[0] != ARRAY)
+            for (unsigned i = 0; i < v[1]; ++ i)
+                h = jstream_mix(h ^ jstream_hash_num(jstream_packed_num(v, i)));
+        return h;
+    }
+    if (kind == OBJECT) return jstream_mix(jstream_hash_seed(OBJECT, 0));
+    return kind < 0 ? 0 : jstream_hash_seed(kind, 0);
+}
+
+/** An array or an object being hashed by jstream_hash: its
+    current item (the value, for a member, whose key has the hash
+    key) is followed by left more, and h is the hash of the
+    previous ones. */
+struct jstream_hashing_s {
+    jstream_t item;
+    unsigned left;
+    int object;
+    uint64_t h, key;
+};
+
+uint64_t jstream_hash(jstream_t v)
+{
+    struct jstream_hashing_s stack0[JSTREAM_DEPTH], *stack = stack0, *f;
+    unsigned depth = 0, cap = JSTREAM_DEPTH;
+    uint64_t h;
+    for (;;) {
+        if ((v[0] == ARRAY || v[0] == OBJECT) && v[1] > 0) {
+            if (depth == cap) {
+                f = jstream_grow_stack(stack, stack0, &cap, sizeof(*stack));
+                if (f == NULL) {
+                    h = 0;
+                    break;
+                }
+                stack = f;
+            }
+            f = stack + depth ++;
+            f->object = v[0] == OBJECT;
+            f->h = jstream_hash_seed((int) v[0], v[1]);
+            f->left = v[1] - 1;
+            f->item = v + 3 + f->object;
+        } else {
+            h = jstream_hash_item(v);
+            // combine h into the containers it completes
+            for (; depth > 0; -- depth) {
+                f = stack + depth - 1;
+                if (f->object) f->h += jstream_mix(f->key ^ h * 0x9e3779b97f4a7c15u);
+                else f->h = jstream_mix(f->h ^ h);
+                if (f->left > 0) break;
+                h = f->object ? jstream_mix(f->h) : f->h;
             }
-            return next;
+            if (depth == 0) break;
+            -- f->left;
+            f->item = jstream_skip(f->item);
+        }
+        if (f->object) {
+            // members are summed, so that their order doesn't count
+            f->key = jstream_hash_item(f->item);
+            f->item = jstream_skip(f->item);
         }
+        v = f->item;
     }
+    if (stack != stack0) free(stack);
+    return h;
+}
+
+/* *** SEGMENTED BLOCKS *** */
+
+/** Header stored before each block allocated by the jstream_vm
+    hooks: reserved is 0 if the block has been allocated by
+    malloc, else the size of the range of addresses reserved for
+    it, of which the first committed bytes (header included) are
+    usable. The size of the header keeps the block aligned to 8
+    bytes, as packed arrays need. */
+struct jstream_vm_s {
+    size_t reserved;
+    size_t committed;
+};
+
+#define JSTREAM_VM_HEADER sizeof(struct jstream_vm_s)
+
+/** Default number of bytes reserved for a block. */
+#define JSTREAM_VM_RESERVE ((size_t) 1 << (sizeof(void*) < 8 ? 28 : 34))
+
+/** Round n up to a multiple of JSTREAM_SEGMENT (0 on overflow). */
+static size_t jstream_vm_round(size_t n)
+{
+    size_t r = n % JSTREAM_SEGMENT;
+    if (r == 0) return n;
+    return n + (JSTREAM_SEGMENT - r) < n ? 0 : n + (JSTREAM_SEGMENT - r);
+}
+
+/** Reserve a range of reserved bytes and commit its first segments,
+    enough for n bytes: return its header, or NULL if that is not
+    possible (which is always the case without mmap). */
+static struct jstream_vm_s *jstream_vm_map(size_t reserved, size_t n)
+{
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+    size_t committed = jstream_vm_round(n);
+    if (committed == 0 || committed > reserved) return NULL;
+    void *m = mmap(NULL, reserved, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED) return NULL;
+    if (mprotect(m, committed, PROT_READ | PROT_WRITE) != 0) {
+        munmap(m, reserved);
+        return NULL;
+    }
+    struct jstream_vm_s *h = m;
+    h->reserved = reserved;
+    h->committed = committed;
+    return h;
+#else
+    (void) reserved;
+    (void) n;
     return NULL;
+#endif
+}
+
+/** Commit the segments of the mapped block h needed for n bytes
+    (n <= h->reserved), or release the ones beyond them to the
+    system if n is smaller: return 0 if that is not possible. */
+static int jstream_vm_commit(struct jstream_vm_s *h, size_t n)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    size_t committed = jstream_vm_round(n);
+    char *m = (char*) h;
+    if (committed > h->committed) {
+        if (mprotect(m + h->committed, committed - h->committed,
+                PROT_READ | PROT_WRITE) != 0)
+            return 0;
+    } else if (committed < h->committed) {
+        // mapping the segments anew drops their pages
+        if (mmap(m + committed, h->committed - committed, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                -1, 0) == MAP_FAILED)
+            return 1;   // they stay committed
+    }
+    h->committed = committed;
+    return 1;
+#else
+    (void) h;
+    (void) n;
+    return 0;
+#endif
+}
+
+void *jstream_vm_alloc(void *user, size_t size)
+{
+    return jstream_vm_realloc(user, NULL, size);
+}
+
+void *jstream_vm_realloc(void *user, void *ptr, size_t size)
+{
+    size_t reserve = user != NULL ? *(const size_t*) user : JSTREAM_VM_RESERVE;
+    struct jstream_vm_s *h = ptr == NULL ? NULL
+        : (struct jstream_vm_s*) ((char*) ptr - JSTREAM_VM_HEADER);
+    size_t n = size + JSTREAM_VM_HEADER;
+    if (n < size) return NULL;
+    if (h != NULL && h->reserved != 0) {
+        // a mapped block grows or shrinks in place, while it fits
+        if (n <= h->reserved)
+            return jstream_vm_commit(h, n) ? ptr : NULL;
+        while (reserve < n && reserve <= SIZE_MAX / 2) reserve *= 2;
+    }
+    struct jstream_vm_s *m = NULL;
+    if (n >= JSTREAM_SEGMENT)
+        m = jstream_vm_map(reserve < n ? jstream_vm_round(n) : reserve, n);
+    if (m == NULL) {
+        if (h != NULL && h->reserved != 0) return NULL;
+        // small blocks, or no way to reserve memory: malloc
+        m = realloc(h, n);
+        if (m == NULL) return NULL;
+        m->reserved = 0;
+        m->committed = n;
+        return (char*) m + JSTREAM_VM_HEADER;
+    }
+    if (h != NULL) {
+        size_t old = h->committed < n ? h->committed : n;
+        memcpy((char*) m + JSTREAM_VM_HEADER, ptr, old - JSTREAM_VM_HEADER);
+        jstream_vm_free(user, ptr);
+    }
+    return (char*) m + JSTREAM_VM_HEADER;
+}
+
+void jstream_vm_free(void *user, void *ptr)
+{
+    (void) user;
+    if (ptr == NULL) return;
+    struct jstream_vm_s *h = (struct jstream_vm_s*) ((char*) ptr - JSTREAM_VM_HEADER);
+#if defined(__unix__) || defined(__APPLE__)
+    if (h->reserved != 0) {
+        munmap(h, h->reserved);
+        return;
+    }
+#endif
+    free(h);
 }
@@ -4,8 +4,14 @@
 #define JSTREAM_INC
 
 #include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** \mainpage
 
     \section json_data Json values in the data object
@@ -21,20 +27,51 @@
         - 4 = string
         - 5 = array
         - 6 = object
+        - 7 = integer
+        - 8 = string reference
+        - 9 = symbol
+        - 10 = array of doubles
+        - 11 = array of integers
 
     After that it follows:
         - If code == 0 or == 1 or == 2, nothing.
         - if code == 3, a double.
-        - if code == 4, a C-string.
+        - if code == 4, an unsigned n (the length of the string)
+            followed by a C-string of n characters.
         - If code == 5, an unsigned n (the number of elements)
-            followed by n values.
-        - If code == 6, an unsigned n (the number of elements)
-            followed by n pairs of values.
+            and an unsigned w (the number of words taken by the
+            whole array, code included) followed by n values.
+        - If code == 6, an unsigned n (the number of elements),
+            an unsigned w (the number of words taken by the
+            whole object, code included) and an unsigned h
+            followed by n pairs of values: if h is not 0, then
+            a hash table of the keys follows them, h words after
+            the code (see jstream_get).
+        - if code == 7, an int64_t.
+        - if code == 8, an unsigned n (the length of the string)
+            followed by the address of its n characters inside
+            the parsed buffer (which are not followed by a '\0').
+        - if code == 9, an unsigned n (the length of the string)
+            and an unsigned b: the string is the same as the one
+            b words before the code (a repeated key, interned).
+        - If code == 10 or 11, an unsigned n (the number of
+            elements), an unsigned w (the number of words taken
+            by the whole array, code included) and an unsigned d
+            followed by n doubles or int64_t's, d words after the
+            code, aligned to 8 bytes from the start of the block.
+
+    Numbers are always stored as doubles, unless integers are
+    asked for when parsing: then numbers without fraction and
+    exponent that fit an int64_t are stored as such.
     
     When parsing a stream, the string representing the value
-    contained in the Json grows to host new data. If an
-    allocation error occurs, all is freed and an error code
-    is returned. */
+    contained in the Json grows to host new data: its capacity
+    is doubled each time it is exhausted, so that the parsing
+    takes amortized linear time, and it is trimmed to the used
+    size once the parsing is over (unless the caller asks not
+    to). Memory is taken from malloc/realloc/free unless the
+    caller provides its own allocation hooks. If an allocation
+    error occurs, all is freed and an error code is returned. */
 
 /** Value codes (null is already represented by NULL). */
 enum {
@@ -43,7 +80,12 @@ enum {
     NUMBER = 3,
     STRING = 4,
     ARRAY = 5,
-    OBJECT = 6
+    OBJECT = 6,
+    INTEGER = 7,
+    STRING_REF = 8,
+    SYMBOL = 9,
+    ARRAY_F64 = 10,
+    ARRAY_I64 = 11
 };
 
 /** Error codes: they are returned in the referenced
@@ -61,6 +103,20 @@ enum {
     ERR_COMMA,
     ERR_COLON,
     ERR_CLOSED_BRACKET,
+    ERR_FILE,
+    ERR_KEY,
+    ERR_HANDLER,
+    ERR_END,
+    ERR_DEPTH,
+    ERR_ESCAPE,
+    ERR_FORMAT,
+};
+
+/** Values returned by jstream_feed. */
+enum {
+    FEED_NEED_MORE,
+    FEED_DONE,
+    FEED_ERROR
 };
 
 /** A jstream is an array of unsigned numbers: strings and
@@ -69,23 +125,155 @@ enum {
     of the ending '\0'), while a double takes 2 items, etc). */
 typedef unsigned *jstream_t;
 
+/** Size in bytes of the input buffer filled by the read
+    function of a struct jstream_param_s. */
+#ifndef JSTREAM_BUFSIZE
+#define JSTREAM_BUFSIZE 16384
+#endif
+
+/** Number of open arrays and objects that a struct
+    jstream_param_s can track without allocating memory. */
+#ifndef JSTREAM_DEPTH
+#define JSTREAM_DEPTH 32
+#endif
+
+/** Size in bytes of the segments committed at a time to a block
+    allocated by jstream_vm_alloc (a multiple of the page size). */
+#ifndef JSTREAM_SEGMENT
+#define JSTREAM_SEGMENT ((size_t) 1 << 20)
+#endif
+
+/** Handlers called by jstream in event mode, each one with the
+    handler_ctx field of the struct jstream_param_s as first
+    argument: any of them may be NULL, and if one of them returns
+    a nonzero value the parsing stops with error ERR_HANDLER.
+    Strings passed to string and key are '\0'-terminated but
+    only last until the handler returns. */
+struct jstream_handler_s {
+    int (*null)(void *ctx);                         ///< null
+    int (*boolean)(void *ctx, int b);               ///< true or false
+    int (*number)(void *ctx, double d);             ///< number
+    int (*integer)(void *ctx, int64_t i);           ///< number (if integers)
+    int (*string)(void *ctx, const char *s, size_t n);  ///< string
+    int (*key)(void *ctx, const char *s, size_t n); ///< key of a member
+    int (*begin_array)(void *ctx);                  ///< '['
+    int (*end_array)(void *ctx, unsigned n);        ///< ']' after n elements
+    int (*begin_object)(void *ctx);                 ///< '{'
+    int (*end_object)(void *ctx, unsigned n);       ///< '}' after n members
+};
+
+/** Statistics of the parsing, accumulated into the structure the
+    stats field of a struct jstream_param_s points to (which is
+    to be zeroed first) by each call to jstream, jstream_parse_buffer,
+    jstream_next_document and the other parsing functions: they
+    are only collected if jstream.c is compiled with JSTREAM_STATS
+    defined, else the counters compile to nothing. */
+struct jstream_stats_s {
+    size_t bytes;       ///< characters consumed from the input
+    size_t values[12];  ///< values stored, per code (keys excluded)
+    size_t keys;        ///< keys of the members stored
+    unsigned max_depth; ///< maximum number of open arrays and objects
+    size_t expands;     ///< calls to enlarge the block
+    size_t reallocs;    ///< reallocations of the block
+    size_t moved;       ///< bytes copied by reallocations which moved it
+    size_t longest_string;  ///< length of the longest string or key
+    double seconds;     ///< time spent parsing
+};
+
+/** An open array or object, when parsing with paths. */
+struct jstream_level_s {
+    uint64_t live;      ///< paths matched up to it (bit 63: all)
+    unsigned index;     ///< number of elements met, if an array
+};
+
 /** Structure used to represent in bytes parsed values from
     a stream. */
 typedef struct jstream_param_s {
 // public
     int error;          ///< error code (0 means no error)
     jstream_t obj;      ///< object under construction
-    unsigned size;      ///< number of words (=unsigned) allocated
+    unsigned size;      ///< number of words (=unsigned) used
+    unsigned capacity;  ///< number of words (=unsigned) allocated
     int (*get)(void);   ///< function that scan the next character
+    int (*get_r)(void *ctx);    ///< same as get, but receives ctx
+    size_t (*read)(void *ctx, char *buf, size_t cap);   ///< function that scan the next block
+    void *ctx;          ///< context passed to get_r and read
     int clast;          ///< last scanned character
+    size_t offset;      ///< offset of clast in the parsed buffer
+// allocation policy (zero fields mean malloc/realloc/free)
+    void *(*mem_alloc)(void *user, size_t size);    ///< allocate a block
+    void *(*mem_realloc)(void *user, void *ptr, size_t size);  ///< resize a block
+    void (*mem_free)(void *user, void *ptr);        ///< release a block
+    void *mem_user;     ///< user pointer passed to the hooks
+    int reuse;          ///< if != 0 keep obj from the previous call
+    int append;         ///< if != 0 store the value after the previous ones
+    int noshrink;       ///< if != 0 do not trim obj to size at the end
+// options
+    int integers;       ///< if != 0 store integral numbers as INTEGER
+    unsigned index;     ///< if != 0 index objects with at least index keys
+    const struct jstream_handler_s *handler;    ///< if != NULL, event mode
+    void *handler_ctx;  ///< context passed to the handlers
+    unsigned max_depth; ///< if != 0 maximum nesting of arrays and objects
+    int refs;           ///< if != 0 strings refer to the parsed buffer
+    int intern;         ///< if != 0 store repeated keys as SYMBOL
+    unsigned intern_values; ///< if != 0 also intern strings up to this length
+    unsigned packed;    ///< if != 0 pack numeric arrays of at least packed elements
+    const char *const *paths;   ///< if != NULL, paths of the values to keep
+    int trust;          ///< if != 0 jstream_load skips the checks of the value
+    struct jstream_stats_s *stats;  ///< if != NULL, statistics (with JSTREAM_STATS)
 // private
     jmp_buf env;        ///< environment used by exceptions
+    const char *base;   ///< parsed buffer (NULL if parsing a stream)
+    const char *text;   ///< buffer STRING_REF values refer to (or NULL)
+    void *map;          ///< file mapped by jstream_parse_file
+    size_t map_size;    ///< size of map
+    void *image;        ///< file mapped by jstream_load
+    size_t image_size;  ///< size of image
+    unsigned *dict;     ///< hash table of the interned strings
+    unsigned dict_size; ///< number of strings in dict
+    unsigned dict_capacity; ///< number of slots allocated in dict
+    const char *(*scan_space)(const char *s, const char *end);  ///< first non space in [s, end)
+    const char *(*scan_quote)(const char *s, const char *end);  ///< first '"' or '\\' in [s, end)
+    const char *(*scan_struct)(const char *s, const char *end); ///< first '"' or bracket in [s, end)
+    const char *cur;    ///< next character to scan in the input buffer
+    const char *end;    ///< end of the input buffer
+    char buf[JSTREAM_BUFSIZE];  ///< input buffer
+    char tmp[128];      ///< scratch buffer used to scan values
+    unsigned *stack;    ///< indexes of the lengths of the open containers
+    unsigned depth;     ///< number of open containers
+    unsigned stack_capacity;    ///< number of items allocated in stack
+    unsigned stack0[JSTREAM_DEPTH];     ///< stack, unless it grows larger
+    struct jstream_level_s *levels;     ///< open containers, if paths
+    struct jstream_level_s levels0[JSTREAM_DEPTH];  ///< levels, unless larger
+    char *feed;         ///< characters passed to jstream_feed
+    size_t feed_size;   ///< number of characters in feed
+    size_t feed_capacity;   ///< number of characters allocated in feed
+    size_t feed_scan;   ///< next character of feed to scan
+    size_t feed_start;  ///< first character of the current value
+    size_t feed_done;   ///< characters of feed already parsed
+    size_t feed_depth;  ///< number of open arrays and objects
+    int feed_state;     ///< state of the scanner of jstream_feed
+    unsigned build_start;   ///< index of the value being built
+    int build_key;      ///< nonzero if a key waits for its value
 } *jstream_param_t;
 
 /** Parse a json stream: it the get field of the structure *p
     to be assigne to a function (pointer) returning the next
     character read from the stream, or a negative value in case
-    of end or error.
+    of end or error. Alternatively, the read field may be
+    assigned to a function that reads up to cap characters
+    from the stream into buf and returns their number (0 in
+    case of end or error): it is called with p->ctx as first
+    argument, and the characters it reads are scanned from an
+    internal buffer, much faster than by one call to get per
+    character. The get_r field may be used in place of get
+    when the function needs a context: it is called with
+    p->ctx as argument. All the state of the parser lives in
+    *p, so that different threads may parse different streams
+    at the same time, each one with its own structure.
+    If read is not NULL, get and get_r are ignored; notice
+    that in this case the characters read after the parsed
+    value, but for clast, are lost.
     Return the following values inside the structure *p:
         obj = pointer to the memory area containing data
         size = length of such area in bytes
@@ -95,18 +283,397 @@ typedef struct jstream_param_s {
     The address obj is also returned as value from the
     function (in case of error it is NULL and no object is
     allocated).
+    Fields not used by the caller should be zero: the mem_alloc,
+    mem_realloc and mem_free hooks, if provided, are all used
+    in place of malloc, realloc and free (and receive mem_user
+    as first argument). If reuse is not 0, then the block found
+    in p->obj (of p->capacity words) is overwritten by the new
+    value instead of allocating a new one, and it is not freed
+    in case of error (p->obj stays available for the next call,
+    while NULL is returned). The block is trimmed to p->size
+    words at the end, unless noshrink or reuse is not 0. If
+    append is not 0, then the value is stored into p->obj after
+    the p->size words it already contains (which are kept in case
+    of error) and its address p->obj + (old value of p->size) is
+    returned: the block is never trimmed nor freed.
+    If p->handler is not NULL, the parsing is done in event mode:
+    no value is stored, but the handlers in *p->handler are called
+    on each item, in the order they are found in the text, and
+    NULL is returned even if p->error == ERR_NONE (memory is
+    only used to scan the currently open arrays and objects and
+    the current scalar value).
+    Arrays and objects are parsed without recursion, keeping the
+    open ones in a stack which lives in *p (and grows on the heap
+    only if they are more than JSTREAM_DEPTH): if p->max_depth is
+    not 0 and more than max_depth of them are open at the same
+    time, the parsing stops with error ERR_DEPTH.
+    The refs option only applies to jstream_parse_buffer and
+    jstream_parse_file, and not in event mode.
+    If p->intern is not 0, the first occurrence of each key is
+    stored as a string, as usual, and entered into a dictionary
+    kept in *p, while each following occurrence is stored as a
+    SYMBOL value, which refers back to the first one: the same
+    applies to string values of at most p->intern_values
+    characters, if intern_values is not 0. The dictionary is
+    emptied when a new block is started (that is, unless append
+    is not 0 and the block is not empty), so that symbols always
+    refer to strings in the same block (see jstream_symbol).
+    If p->packed is not 0, each array of at least p->packed
+    elements which are all numbers is stored as an ARRAY_F64
+    value, whose elements are contiguous doubles, or as an
+    ARRAY_I64 value if they are all INTEGERs (see integers):
+    INTEGERs mixed with doubles are converted, unless they are
+    too large to be exact as doubles, in which case the array
+    is not packed.
+    If p->paths is not NULL, it is a NULL-terminated array of at
+    most 63 JSON Pointers (RFC 6901, e.g. "/user/id"), where a
+    "*" token matches any key or index: only the values they
+    point to are stored (or passed to the handlers), inside the
+    arrays and objects which contain them, while anything else
+    is skipped by a scan which only tracks strings and brackets,
+    without storing nor converting nor validating it. Arrays
+    keep the order of their elements, but not their indexes.
     Warning: it is the caller responsibility to deallocate
-    p->obj once it is no longer needed, via free(p->obj). */
+    p->obj once it is no longer needed, via jstream_free(p)
+    (or free(p->obj) if no hooks are provided). */
 extern jstream_t jstream(jstream_param_t p);
 
-/** Dump an jstream_t object to a text file. Return the
-    address of the first item following the object in the
-    array obj. */
+/** Same as jstream, but parse the n characters starting at s
+    instead of a stream: the get, get_r and read fields of *p
+    are ignored. Besides the values returned by jstream, the
+    offset in s of the character clast is returned in
+    p->offset (if the value is followed by other characters,
+    this is where parsing may go on), equal to n if no
+    character follows the value.
+    If p->refs is not 0, strings without escape sequences are
+    not copied into p->obj (unless they are shorter than a
+    pointer, so that a copy is smaller): they are stored as
+    STRING_REF values,
+    which refer to their characters inside s, and thus are valid
+    as long as s is (the same applies to the values parsed from
+    s by jstream_next_document). Strings containing escapes are
+    decoded and stored as STRING values anyway. */
+extern jstream_t jstream_parse_buffer(jstream_param_t p, const char *s, size_t n);
+
+/** Parse the value following the one parsed by the previous
+    call to jstream, jstream_parse_buffer or jstream_next_document
+    with the same structure *p, which starts with p->clast and
+    goes on with the characters still in the input buffer (thus
+    a stream or buffer containing more Json values, e.g. one per
+    line, can be parsed value by value). Values are returned as
+    in jstream: if reuse is not 0, each value is stored into the
+    same block p->obj. If the input is over, NULL is returned
+    and p->error is ERR_END. */
+extern jstream_t jstream_next_document(jstream_param_t p);
+
+/** Same as jstream_parse_buffer, but parse the content of the
+    file with the given name, mapped in memory: if the file
+    can't be opened or mapped, p->error is set to ERR_FILE.
+    The file stays mapped, so that jstream_next_document can parse
+    the values following the first one and STRING_REF values (if
+    p->refs is not 0) refer to it, until jstream_free(p) or the
+    next call to jstream_parse_file with p. */
+extern jstream_t jstream_parse_file(jstream_param_t p, const char *name);
+
+/** Push the n characters starting at s to the parser *p, which
+    stores them in an internal buffer and scans them, keeping
+    track of strings, escapes and nesting in the fields of *p
+    (thus without any recursion nor blocking), to find where the
+    value they contain ends. Return FEED_NEED_MORE if the value
+    is not over yet: then call jstream_feed again as soon as more
+    characters are available. Once the value is complete it is
+    parsed as by jstream_parse_buffer and FEED_DONE is returned
+    (or FEED_ERROR, with the error code in p->error): characters
+    following the value are kept for the next one, which is
+    returned by the next call (that may pass no characters).
+    Call jstream_feed(p, NULL, 0) at the end of the input: a
+    number at top level, which has no terminator, is then parsed,
+    while if no value was started FEED_ERROR is returned with
+    p->error == ERR_END. Memory used by the buffer is released by
+    jstream_free. */
+extern int jstream_feed(jstream_param_t p, const char *s, size_t n);
+
+/** Save the value obj (which may be a whole block returned by
+    jstream) into the file with the given name, so that it can
+    be loaded by jstream_load without parsing. The file contains
+    a header of 40 bytes, that is the magic "JSTREAM" followed
+    by the format version (1), the number 0x01020304 and the
+    size of a word (as 32 bits integers in the byte order of the
+    machine), the number of words of the value (as a 64 bits
+    integer), the number of padding words between the header and
+    the value (0 or 1, so that the value has the same alignment
+    to 8 bytes it has in memory), a reserved 32 bits 0, and a 64
+    bits checksum of the words of the value; then the padding
+    and the words of the value follow. Return ERR_NONE, or
+    ERR_FILE if the file can't be written, or ERR_VALUE if obj
+    contains STRING_REF values, whose addresses can't be saved,
+    or SYMBOL values referring to strings before obj (as in an
+    item of a block parsed with the intern option). */
+extern int jstream_save(jstream_t obj, const char *name);
+
+/** Map in memory the file with the given name, written by
+    jstream_save, and return the address of the value it
+    contains, which is valid until jstream_free(p) (or the next
+    call to jstream_load with p) and can't be modified: the
+    block p->obj, if any, is left alone, as is the file mapped
+    by jstream_parse_file, which STRING_REF values in it may
+    refer to (and jstream_parse_file leaves alone the file
+    mapped by jstream_load). The header is checked,
+    then, unless p->trust is not 0, the checksum and the
+    structure of the value, by a pass over its words, so that
+    codes, lengths, spans, hash tables and SYMBOL values can be
+    followed without leaving it.
+    If the file can't be opened or mapped, NULL is returned and
+    p->error is set to ERR_FILE, or to ERR_FORMAT if it is not
+    in the format of jstream_save for this machine (files are
+    not portable between machines with a different byte order
+    or word size). */
+extern jstream_t jstream_load(jstream_param_t p, const char *name);
+
+/** Start building a value into the block p->obj, item by item,
+    without any text: the value is stored as by jstream (the
+    fields reuse, append, noshrink, index, packed, intern,
+    intern_values, max_depth and the allocation hooks of *p are
+    used as when parsing), by calling the following functions,
+    in the order the items would appear in the text, and then
+    jstream_build_end. Each of them returns ERR_NONE, or the
+    error code, which is also stored in p->error, and stays
+    there: the following calls do nothing, so that the error
+    may be checked only once the value is over. The errors are
+    ERR_MEMORY, ERR_DEPTH, ERR_KEY if a value is added to an
+    object where a key is expected, ERR_VALUE if a key is added
+    where a value is expected (or a second value at top level),
+    and ERR_CLOSED_BRACKET if the container to be closed is not
+    the innermost open one. */
+extern void jstream_build_begin(jstream_param_t p);
+
+/** Open an array: the following values, up to the matching
+    jstream_end_array, are its elements, counted as they come. */
+extern int jstream_begin_array(jstream_param_t p);
+
+/** Close the innermost open container, which must be an array. */
+extern int jstream_end_array(jstream_param_t p);
+
+/** Open an object: its members, up to the matching
+    jstream_end_object, are added as a key followed by a value. */
+extern int jstream_begin_object(jstream_param_t p);
+
+/** Close the innermost open container, which must be an object. */
+extern int jstream_end_object(jstream_param_t p);
+
+/** Add the key of a member of the innermost open object, which
+    is the string of n characters starting at s (copied as they
+    are, without escapes). */
+extern int jstream_add_key(jstream_param_t p, const char *s, size_t n);
+
+/** Add a STRING value, the n characters starting at s. */
+extern int jstream_add_string(jstream_param_t p, const char *s, size_t n);
+
+/** Add a NUMBER value. */
+extern int jstream_add_number(jstream_param_t p, double d);
+
+/** Add an INTEGER value. */
+extern int jstream_add_integer(jstream_param_t p, int64_t i);
+
+/** Add a TRUE value if b is not 0, else a FALSE value. */
+extern int jstream_add_bool(jstream_param_t p, int b);
+
+/** Add a NULL value. */
+extern int jstream_add_null(jstream_param_t p);
+
+/** Complete the value built since jstream_build_begin and return
+    its address, as jstream does, that is the value is to be
+    released by jstream_free(p). If an error occurred, or some
+    container is still open (ERR_CLOSED_BRACKET), or no value
+    was added (ERR_END), NULL is returned with the error code in
+    p->error, and the value is dropped. This function must be
+    called to end the building anyway, since it releases the
+    memory used to track the open containers. */
+extern jstream_t jstream_build_end(jstream_param_t p);
+
+/** Release the block p->obj by means of the allocation hooks
+    in *p and reset p->obj, p->size and p->capacity (as well as
+    the buffer used by jstream_feed, the files mapped by
+    jstream_parse_file and jstream_load and the dictionary of
+    interned strings, if any). */
+extern void jstream_free(jstream_param_t p);
+
+/** Allocation hooks which keep the block of a parsing in place:
+    assigned to mem_alloc, mem_realloc and mem_free of a struct
+    jstream_param_s (or jstream_writer_s), each block of at least
+    JSTREAM_SEGMENT bytes is given a range of addresses reserved
+    in advance, of *(size_t*) mem_user bytes (or 16 GB if mem_user
+    is NULL, 256 MB on 32 bit systems), whose segments of
+    JSTREAM_SEGMENT bytes are committed as the block grows and
+    released to the system when it shrinks. The block thus never
+    moves nor is copied while it fits its range, so that its
+    growth by doubling costs no copy and the resident memory is
+    only the one of the segments used; if it outgrows the range,
+    it is moved once to a range twice as large. Smaller blocks,
+    and all of them on systems without mmap, are allocated by
+    malloc. The block remains a contiguous array, which is read
+    as any other one, but it must be released by jstream_vm_free
+    (e.g. by jstream_free). */
+extern void *jstream_vm_alloc(void *user, size_t size);
+
+/** Resize a block allocated by jstream_vm_alloc, see above. */
+extern void *jstream_vm_realloc(void *user, void *ptr, size_t size);
+
+/** Release a block allocated by jstream_vm_alloc. */
+extern void jstream_vm_free(void *user, void *ptr);
+
+/** Dump an jstream_t object to a text file, in compact Json
+    format, by means of jstream_write. Return the address of the
+    first item following the object in the array obj. */
 extern jstream_t jstream_dump(FILE *f, jstream_t obj);
 
+/** An array or an object being written by jstream_write. */
+struct jstream_frame_s {
+    jstream_t obj;      ///< the container
+    unsigned left;      ///< number of items still to be written
+};
+
+/** Structure used to pass and receive parameters to and from
+    jstream_write: its fields should be zero, but for the ones
+    that are used. */
+typedef struct jstream_writer_s {
+// public
+    int error;          ///< error code (0 means no error)
+    char *buf;          ///< output buffer
+    size_t size;        ///< number of characters in buf
+    size_t capacity;    ///< number of characters allocated in buf
+    size_t (*write)(void *ctx, const char *s, size_t n);    ///< if != NULL, function that writes the buffer
+    void *ctx;          ///< context passed to write
+    unsigned indent;    ///< if != 0 pretty print, indenting by indent spaces
+// allocation policy (zero fields mean malloc/realloc/free)
+    void *(*mem_alloc)(void *user, size_t size);    ///< allocate a block
+    void *(*mem_realloc)(void *user, void *ptr, size_t size);  ///< resize a block
+    void (*mem_free)(void *user, void *ptr);        ///< release a block
+    void *mem_user;     ///< user pointer passed to the hooks
+// private
+    jmp_buf env;        ///< environment used by exceptions
+    int own;            ///< nonzero if buf has been allocated by the writer
+    struct jstream_frame_s *stack;  ///< open containers
+    unsigned depth;     ///< number of open containers
+    unsigned stack_capacity;    ///< number of items allocated in stack
+    struct jstream_frame_s stack0[JSTREAM_DEPTH];   ///< stack, unless it grows larger
+} *jstream_writer_t;
+
+/** Write the value obj as Json text into the buffer w->buf,
+    without recursion. Numbers are written with the shortest
+    sequence of digits which is parsed back to the same double
+    (and integers exactly), strings as they are stored. If
+    w->indent is 0 the text is compact, else it is indented by
+    w->indent spaces per level, one item per line.
+    If w->write is NULL, the buffer grows as needed and at the
+    end it contains the whole text, which is w->size characters
+    long (and followed by a '\0'): more calls append more values.
+    Else, each time the buffer is full, it is passed to w->write,
+    which must write its w->size characters and return their
+    number, and then it is emptied: call jstream_flush at the
+    end, to write what is left in it. In both cases, if buf is
+    NULL, it is allocated by the hooks in *w (in the second case
+    once and for all, of JSTREAM_BUFSIZE characters), else it
+    must contain capacity characters, and it is never freed by
+    the writer (if it is full and w->write is NULL, the text is
+    copied into a new, larger, buffer).
+    Return the address of the first item following the value,
+    or NULL in case of error: then w->error is ERR_MEMORY, or
+    ERR_FILE if w->write failed, or ERR_VALUE if obj contains an
+    invalid code. */
+extern jstream_t jstream_write(jstream_writer_t w, jstream_t obj);
+
+/** Pass the characters in the buffer of w to w->write, if it is
+    not NULL, and empty it: return w->error. */
+extern int jstream_flush(jstream_writer_t w);
+
+/** Release the buffer of w, if allocated by the writer, and
+    reset w->buf, w->size and w->capacity. */
+extern void jstream_write_free(jstream_writer_t w);
+
 /** Given the address of a Json value s dumped by jstream, return
-    the address of the value immediately following it. If the code
-    at obj[0] is not valid, return NULL. */
+    the address of the value immediately following it, in constant
+    time. If the code at obj[0] is not valid, return NULL. */
 extern jstream_t jstream_skip(jstream_t obj);
 
+/** Given the address of a Json value obj dumped by jstream,
+    return the address of the value associated to key if obj
+    is an object containing it, else NULL (if the key appears
+    more than once, the first value is returned). If the object
+    has been indexed while parsing (see the index field of
+    struct jstream_param_s), the key is looked up in its hash
+    table, else by scanning the keys in order. */
+extern jstream_t jstream_get(jstream_t obj, const char *key);
+
+/** Same as jstream_get, for the key of len characters starting
+    at key, which need not be '\0'-terminated. */
+extern jstream_t jstream_get_key(jstream_t obj, const char *key, size_t len);
+
+/** Given the address of a Json value v dumped by jstream, return
+    the address of its characters if it is a STRING or STRING_REF
+    value, else NULL, storing their number into *len (unless len
+    is NULL). Notice that the characters of a STRING_REF value
+    are not followed by a '\0'. */
+extern const char *jstream_str(jstream_t v, unsigned *len);
+
+/** Given the address of a Json value v dumped by jstream, return
+    the address of its elements if it is an ARRAY_F64 value, else
+    NULL, storing their number into *n (unless n is NULL). */
+extern const double *jstream_f64(jstream_t v, unsigned *n);
+
+/** Same as jstream_f64, for ARRAY_I64 values. */
+extern const int64_t *jstream_i64(jstream_t v, unsigned *n);
+
+/** Given the address of a string value v (of any kind), return
+    the address of the first occurrence of the string, to which
+    v refers if it is a SYMBOL, else v itself: when the intern
+    option is used, two interned strings in the same block are
+    equal exactly when they have the same first occurrence. */
+extern jstream_t jstream_symbol(jstream_t v);
+
+/** Same as jstream_get, but look for the key whose first
+    occurrence is jstream_symbol(key), where key is a string
+    value in the same block as obj (e.g. a key of a previous
+    object), comparing addresses instead of characters unless
+    the object has been indexed: this is how records sharing
+    the same keys, parsed with p->intern set, are looked up. */
+extern jstream_t jstream_get_symbol(jstream_t obj, jstream_t key);
+
+/** Return the address of the k-th token (counting from 0) of
+    the JSON Pointer path, or NULL if it has less tokens, storing
+    its length into *len: this is how p->paths are read. */
+extern const char *jstream_pointer_token(const char *path, unsigned k, size_t *len);
+
+/** Return nonzero if the token t of n characters, as returned by
+    jstream_pointer_token, matches the key of len characters
+    starting at key (the escapes ~0 and ~1 of t stand for '~' and
+    '/'; "*" is not special here). */
+extern int jstream_pointer_key(const char *t, size_t n, const char *key, size_t len);
+
+/** Return nonzero if the values a and b are equal as Json values,
+    comparing their items in place, without recursion: numbers are
+    equal if they have the same value (be they NUMBER or INTEGER),
+    strings if they have the same characters (of any kind), arrays
+    (packed or not) and objects if their items are equal in the
+    same order, but if unordered is not 0 objects are also equal
+    when they have the same keys in any order, each key with
+    equal values (the members having the same key are matched in
+    the order they appear in either object). If the values are
+    nested more than JSTREAM_DEPTH levels and there is no memory
+    to track the deeper ones, -1 is returned. */
+extern int jstream_equal(jstream_t a, jstream_t b, int unordered);
+
+/** Return a 64 bit hash of the value v, computed in place without
+    recursion, which is the same for values equal according to
+    jstream_equal, in either mode (the members of an object are
+    combined regardless of their order), and stable across runs
+    and platforms, so that it can be stored to deduplicate values.
+    If v is nested more than JSTREAM_DEPTH levels and there is no
+    memory to track the deeper ones, 0 is returned. */
+extern uint64_t jstream_hash(jstream_t v);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,498 @@
+/** \file jstream.hpp */
+
+/** A header-only C++17 layer on jstream, in namespace jst (the
+    name jstream being taken by the parsing function): value_view,
+    array_view and object_view are non-owning views of the values
+    stored in a block (a pointer each, passed by value), whose
+    accessors and iterators decode the binary format inline,
+    parser owns a struct jstream_param_s and releases it when
+    destroyed, and document owns a block taken from a parser, by
+    a unique_ptr whose deleter uses the allocation hooks of the
+    parser.
+
+        jst::parser p;
+        p.options().index = 8;
+        jst::value_view v = p.parse(text);
+        for (auto m : v.as_object())
+            std::cout << m.key << '\n';
+        double x = v["score"].as_double();
+
+    Views never throw: a default view (NULL) is returned where
+    the value is missing or of another kind, and its accessors
+    return empty or zero values. */
+
+#ifndef JSTREAM_HPP_INC
+#define JSTREAM_HPP_INC
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include "jstream.h"
+
+namespace jst {
+
+/** Kinds of values, i.e. the codes stored in their first word. */
+enum class value_kind : unsigned {
+    null = 0,
+    true_value = TRUE,
+    false_value = FALSE,
+    number = NUMBER,
+    string = STRING,
+    array = ARRAY,
+    object = OBJECT,
+    integer = INTEGER,
+    string_ref = STRING_REF,
+    symbol = SYMBOL,
+    array_f64 = ARRAY_F64,
+    array_i64 = ARRAY_I64,
+};
+
+namespace detail {
+
+/** Same as jstream_skip, inline. */
+inline jstream_t skip(jstream_t v) noexcept
+{
+    switch (v[0]) {
+        case 0 /* NULL */: case FALSE: case TRUE:
+            return v + 1;
+        case NUMBER:
+            return v + 1 + sizeof(double)/sizeof(unsigned);
+        case INTEGER:
+            return v + 1 + sizeof(int64_t)/sizeof(unsigned);
+        case STRING:
+            return v + 2 + (v[1] + sizeof(unsigned)) / sizeof(unsigned);
+        case STRING_REF:
+            return v + 2 + sizeof(char*)/sizeof(unsigned);
+        case SYMBOL:
+            return v + 3;
+        case ARRAY: case OBJECT: case ARRAY_F64: case ARRAY_I64:
+            return v + v[2];
+    }
+    return nullptr;
+}
+
+/** Same as jstream_str, inline: an empty view if v is not a
+    string. */
+inline std::string_view str(jstream_t v) noexcept
+{
+    if (v[0] == SYMBOL) v -= v[2];
+    if (v[0] == STRING) return {reinterpret_cast<const char*>(v + 2), v[1]};
+    if (v[0] != STRING_REF) return {};
+    const char *s;
+    std::memcpy(&s, v + 2, sizeof(s));
+    return {s, v[1]};
+}
+
+} // namespace detail
+
+class array_view;
+class object_view;
+
+/** The elements of an ARRAY_F64 or ARRAY_I64 value, as a
+    contiguous range of T. */
+template <class T>
+class packed_view {
+public:
+    constexpr packed_view() noexcept = default;
+    constexpr packed_view(const T *data, std::size_t n) noexcept : data_(data), size_(n) {}
+    constexpr const T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr const T *begin() const noexcept { return data_; }
+    constexpr const T *end() const noexcept { return data_ + size_; }
+    constexpr const T &operator[](std::size_t i) const noexcept { return data_[i]; }
+private:
+    const T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/** A value stored in a block, or no value if it is NULL. */
+class value_view {
+public:
+    constexpr value_view() noexcept = default;
+    constexpr explicit value_view(jstream_t v) noexcept : v_(v) {}
+
+    /** True unless this is a default view. */
+    constexpr explicit operator bool() const noexcept { return v_ != nullptr; }
+
+    /** The address of the value, to be passed to the C functions. */
+    constexpr jstream_t raw() const noexcept { return v_; }
+
+    /** The code of the value (null for a default view). */
+    value_kind kind() const noexcept
+    {
+        return v_ == nullptr ? value_kind::null : static_cast<value_kind>(v_[0]);
+    }
+    bool is_null() const noexcept { return v_ != nullptr && v_[0] == 0; }
+    bool is_bool() const noexcept { return v_ != nullptr && (v_[0] == TRUE || v_[0] == FALSE); }
+    bool is_number() const noexcept { return v_ != nullptr && (v_[0] == NUMBER || v_[0] == INTEGER); }
+    bool is_integer() const noexcept { return v_ != nullptr && v_[0] == INTEGER; }
+    bool is_string() const noexcept
+    {
+        return v_ != nullptr && (v_[0] == STRING || v_[0] == STRING_REF || v_[0] == SYMBOL);
+    }
+    /** True for ARRAY values as well as for packed arrays. */
+    bool is_array() const noexcept
+    {
+        return v_ != nullptr && (v_[0] == ARRAY || v_[0] == ARRAY_F64 || v_[0] == ARRAY_I64);
+    }
+    bool is_object() const noexcept { return v_ != nullptr && v_[0] == OBJECT; }
+
+    /** True if the value is TRUE. */
+    bool as_bool() const noexcept { return v_ != nullptr && v_[0] == TRUE; }
+
+    /** The number, converted to a double if it is an INTEGER (0 if
+        the value is not a number). */
+    double as_double() const noexcept
+    {
+        if (v_ == nullptr) return 0;
+        if (v_[0] == NUMBER) return load<double>();
+        return v_[0] == INTEGER ? static_cast<double>(load<int64_t>()) : 0;
+    }
+
+    /** The number, truncated to an integer if it is a NUMBER (0 if
+        the value is not a number, or a NUMBER out of the range of
+        int64_t). */
+    int64_t as_int64() const noexcept
+    {
+        if (v_ == nullptr) return 0;
+        if (v_[0] == INTEGER) return load<int64_t>();
+        if (v_[0] != NUMBER) return 0;
+        double d = load<double>();
+        // false for NaN as well
+        return d >= -9223372036854775808.0 && d < 9223372036854775808.0
+            ? static_cast<int64_t>(d) : 0;
+    }
+
+    /** The characters of a string of any kind (empty if the value
+        is not a string): they are '\0'-terminated only if it is a
+        STRING value, or a SYMBOL referring to one. */
+    std::string_view as_string() const noexcept
+    {
+        return v_ == nullptr ? std::string_view() : detail::str(v_);
+    }
+
+    /** The elements of an ARRAY_F64 value (empty otherwise). */
+    packed_view<double> as_f64() const noexcept
+    {
+        unsigned n = 0;
+        const double *d = v_ == nullptr ? nullptr : jstream_f64(v_, &n);
+        return {d, n};
+    }
+
+    /** The elements of an ARRAY_I64 value (empty otherwise). */
+    packed_view<int64_t> as_i64() const noexcept
+    {
+        unsigned n = 0;
+        const int64_t *i = v_ == nullptr ? nullptr : jstream_i64(v_, &n);
+        return {i, n};
+    }
+
+    inline array_view as_array() const noexcept;
+    inline object_view as_object() const noexcept;
+
+    /** The value of the member with the given key, if this is an
+        object containing it. */
+    inline value_view operator[](std::string_view key) const noexcept;
+
+    /** The value following this one in the block (a default view
+        for a default view). */
+    value_view next() const noexcept
+    {
+        return v_ == nullptr ? value_view() : value_view(detail::skip(v_));
+    }
+
+    /** The number of words taken by the value (0 for a default
+        view). */
+    std::size_t words() const noexcept
+    {
+        return v_ == nullptr ? 0 : static_cast<std::size_t>(detail::skip(v_) - v_);
+    }
+
+private:
+    template <class T>
+    T load() const noexcept
+    {
+        T x;
+        std::memcpy(&x, v_ + 1, sizeof(x));
+        return x;
+    }
+
+    jstream_t v_ = nullptr;
+};
+
+/** The elements of an ARRAY value, iterated in order: packed
+    arrays have a size but no elements to iterate, and are read
+    by value_view::as_f64 and value_view::as_i64. */
+class array_view {
+public:
+    /** A forward iterator on the elements, each skipped in
+        constant time. */
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = value_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = value_view;
+
+        constexpr iterator() noexcept = default;
+        constexpr explicit iterator(jstream_t v) noexcept : v_(v) {}
+        value_view operator*() const noexcept { return value_view(v_); }
+        iterator &operator++() noexcept
+        {
+            v_ = detail::skip(v_);
+            return *this;
+        }
+        iterator operator++(int) noexcept
+        {
+            iterator i = *this;
+            ++ *this;
+            return i;
+        }
+        constexpr bool operator==(const iterator &i) const noexcept { return v_ == i.v_; }
+        constexpr bool operator!=(const iterator &i) const noexcept { return v_ != i.v_; }
+    private:
+        jstream_t v_ = nullptr;
+    };
+
+    constexpr array_view() noexcept = default;
+    constexpr explicit array_view(jstream_t v) noexcept : v_(v) {}
+    constexpr jstream_t raw() const noexcept { return v_; }
+    std::size_t size() const noexcept { return v_ == nullptr ? 0 : v_[1]; }
+    bool empty() const noexcept { return size() == 0; }
+    /** True if the array is packed (see value_view::as_f64). */
+    bool packed() const noexcept { return v_ != nullptr && v_[0] != ARRAY; }
+    iterator begin() const noexcept { return iterator(packed() || v_ == nullptr ? end_() : v_ + 3); }
+    iterator end() const noexcept { return iterator(end_()); }
+private:
+    jstream_t end_() const noexcept { return v_ == nullptr ? nullptr : v_ + v_[2]; }
+
+    jstream_t v_ = nullptr;
+};
+
+/** A member of an object. */
+struct member {
+    std::string_view key;   ///< its key
+    value_view value;       ///< its value
+};
+
+/** The members of an OBJECT value, iterated in order. */
+class object_view {
+public:
+    /** A forward iterator on the members. */
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = member;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = member;
+
+        constexpr iterator() noexcept = default;
+        constexpr explicit iterator(jstream_t k) noexcept : k_(k) {}
+        member operator*() const noexcept
+        {
+            return {detail::str(k_), value_view(detail::skip(k_))};
+        }
+        iterator &operator++() noexcept
+        {
+            k_ = detail::skip(detail::skip(k_));
+            return *this;
+        }
+        iterator operator++(int) noexcept
+        {
+            iterator i = *this;
+            ++ *this;
+            return i;
+        }
+        constexpr bool operator==(const iterator &i) const noexcept { return k_ == i.k_; }
+        constexpr bool operator!=(const iterator &i) const noexcept { return k_ != i.k_; }
+    private:
+        jstream_t k_ = nullptr;     // key of the member
+    };
+
+    constexpr object_view() noexcept = default;
+    constexpr explicit object_view(jstream_t v) noexcept : v_(v) {}
+    constexpr jstream_t raw() const noexcept { return v_; }
+    std::size_t size() const noexcept { return v_ == nullptr ? 0 : v_[1]; }
+    bool empty() const noexcept { return size() == 0; }
+    iterator begin() const noexcept { return iterator(v_ == nullptr ? nullptr : v_ + 4); }
+    /** The members end where the hash table of the keys, if any,
+        starts. */
+    iterator end() const noexcept
+    {
+        return iterator(v_ == nullptr ? nullptr : v_ + (v_[3] != 0 ? v_[3] : v_[2]));
+    }
+
+    /** The value of the first member with the given key, looked
+        up in the hash table of the object if it has been indexed
+        (see jstream_get), else a default view. */
+    value_view find(std::string_view key) const noexcept
+    {
+        if (v_ == nullptr) return {};
+        if (v_[3] != 0) return value_view(jstream_get_key(v_, key.data(), key.size()));
+        for (member m : *this)
+            if (m.key == key) return m.value;
+        return {};
+    }
+    value_view operator[](std::string_view key) const noexcept { return find(key); }
+private:
+    jstream_t v_ = nullptr;
+};
+
+inline array_view value_view::as_array() const noexcept
+{
+    return is_array() ? array_view(v_) : array_view();
+}
+
+inline object_view value_view::as_object() const noexcept
+{
+    return is_object() ? object_view(v_) : object_view();
+}
+
+inline value_view value_view::operator[](std::string_view key) const noexcept
+{
+    return as_object().find(key);
+}
+
+/** Deleter of a block allocated by the hooks of a struct
+    jstream_param_s (or malloc, if they are NULL). */
+struct block_deleter {
+    void (*mem_free)(void *user, void *ptr) = nullptr;  ///< free hook
+    void *mem_user = nullptr;   ///< user pointer passed to mem_free
+    void operator()(unsigned *obj) const noexcept
+    {
+        if (mem_free == nullptr) std::free(obj);
+        else mem_free(mem_user, obj);
+    }
+};
+
+/** A block owned by a unique_ptr. */
+using block_ptr = std::unique_ptr<unsigned[], block_deleter>;
+
+/** A parsed value, which owns its block. */
+class document {
+public:
+    document() noexcept = default;
+    document(block_ptr block, jstream_t root) noexcept
+        : block_(std::move(block)), root_(root) {}
+    explicit operator bool() const noexcept { return root_ != nullptr; }
+    value_view root() const noexcept { return value_view(root_); }
+    block_ptr &block() noexcept { return block_; }
+private:
+    block_ptr block_;
+    jstream_t root_ = nullptr;
+};
+
+/** A parser, i.e. a struct jstream_param_s released by
+    jstream_free when the parser is destroyed: the values it
+    returns are valid until the next call which parses with the
+    same parser, that releases their block (unless its reuse or
+    append options are set), or until release takes it.
+    Options, as well as the error and the offset where the
+    parsing stopped, are the fields of options(). A parser is
+    large (it contains the input buffer) and can't be copied nor
+    moved. */
+class parser {
+public:
+    parser() noexcept : p_() {}
+    parser(const parser &) = delete;
+    parser &operator=(const parser &) = delete;
+    ~parser() { jstream_free(&p_); }
+
+    struct jstream_param_s &options() noexcept { return p_; }
+    int error() const noexcept { return p_.error; }
+    std::size_t offset() const noexcept { return p_.offset; }
+
+    /** Parse a text in memory, by jstream_parse_buffer. */
+    value_view parse(std::string_view s) noexcept
+    {
+        drop();
+        return value_view(jstream_parse_buffer(&p_, s.data(), s.size()));
+    }
+
+    /** Parse a file, by jstream_parse_file. */
+    value_view parse_file(const char *name) noexcept
+    {
+        drop();
+        return value_view(jstream_parse_file(&p_, name));
+    }
+
+    /** Parse the text read from src, an object with a member
+        std::size_t read(char *buf, std::size_t cap), which reads
+        up to cap characters into buf and returns their number (0
+        at the end): it is called through p->read once per block
+        of JSTREAM_BUFSIZE characters, while the characters are
+        scanned inside the library. */
+    template <class Source>
+    value_view parse_stream(Source &src) noexcept
+    {
+        drop();
+        p_.get = nullptr;
+        p_.get_r = nullptr;
+        p_.read = &read<Source>;
+        p_.ctx = &src;
+        return value_view(jstream(&p_));
+    }
+
+    /** Parse the value following the previous one, by
+        jstream_next_document. */
+    value_view next() noexcept
+    {
+        drop();
+        return value_view(jstream_next_document(&p_));
+    }
+
+    /** Map a file saved by jstream_save, by jstream_load. */
+    value_view load(const char *name) noexcept
+    {
+        return value_view(jstream_load(&p_, name));
+    }
+
+    /** Take the block of the last value parsed (or built), whose
+        root is v, which then lasts as long as the returned
+        document, however the parser is used, but for its
+        STRING_REF values, which still refer to the text they have
+        been parsed from: after parse_file with the refs option,
+        that is the mapping of the file, which the parser unmaps
+        when it maps another file or is destroyed. If v is not in
+        the block (e.g. it has been loaded), an empty document is
+        returned. */
+    document release(value_view v) noexcept
+    {
+        if (!v || v.raw() < p_.obj || v.raw() >= p_.obj + p_.size) return {};
+        block_ptr block(p_.obj, block_deleter{p_.mem_free, p_.mem_user});
+        p_.obj = nullptr;
+        p_.size = p_.capacity = 0;
+        return document(std::move(block), v.raw());
+    }
+
+private:
+    /** Release the block of the previous value, which the next
+        one would replace, unless it is to be kept. */
+    void drop() noexcept
+    {
+        if (p_.reuse || p_.append || p_.obj == nullptr) return;
+        block_deleter{p_.mem_free, p_.mem_user}(p_.obj);
+        p_.obj = nullptr;
+        p_.size = p_.capacity = 0;
+    }
+
+    template <class Source>
+    static std::size_t read(void *ctx, char *buf, std::size_t cap)
+    {
+        return static_cast<Source*>(ctx)->read(buf, cap);
+    }
+
+    struct jstream_param_s p_;
+};
+
+} // namespace jst
+
+#endif
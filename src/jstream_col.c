@@ -0,0 +1,404 @@
+/** \file jstream_col.c */
+
+/** \section json_columns Columnar extraction
+
+    The records are parsed in event mode, with the paths of the
+    columns as filter, so that the handlers only see the members
+    leading to the values of the columns. The handlers track the
+    open arrays and objects: for each open object of a record,
+    live has a bit set for each column whose path matches the keys
+    leading to it, and for the current member key has the bits of
+    the columns whose next token matches its key. A scalar value
+    fills the columns of key whose path ends with that token,
+    unless they were already filled in the row. A row is made
+    ready for values (with no value in any column) when its
+    record is opened and counted when it is closed, so that the
+    values of a record which can't be parsed are dropped. */
+
+/* *** MODULE jstream_col *** */
+
+#include <stdlib.h>
+#include <string.h>
+#include "jstream_col.h"
+
+/* *** PRIVATE STUFF *** */
+
+/** Number of rows first allocated in the columns. */
+#define JSTREAM_ROWS 1024
+
+/** Resize the block ptr to size bytes (allocate it if ptr is
+    NULL) by the allocation hooks of c. */
+static void *jstream_col_realloc(jstream_columns_t c, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return c->mem_alloc == NULL ? malloc(size)
+            : c->mem_alloc(c->mem_user, size);
+    return c->mem_realloc == NULL ? realloc(ptr, size)
+        : c->mem_realloc(c->mem_user, ptr, size);
+}
+
+/** Release memory by the allocation hooks of c. */
+static void jstream_col_release(jstream_columns_t c, void *ptr)
+{
+    if (ptr == NULL) return;
+    if (c->mem_free == NULL) free(ptr);
+    else c->mem_free(c->mem_user, ptr);
+}
+
+/** Size in bytes of a value of the column k. */
+static size_t jstream_col_width(const struct jstream_column_s *k)
+{
+    switch (k->type) {
+        case COLUMN_BOOL:
+            return 1;
+        case COLUMN_STR:
+            return sizeof(uint64_t);
+    }
+    return 8;
+}
+
+/** Enlarge the columns to cap rows: return 0 if there is no
+    memory (the columns which have been enlarged keep their new
+    size, which is harmless). */
+static int jstream_col_grow(jstream_columns_t c, size_t cap)
+{
+    for (unsigned i = 0; i < c->n; ++ i) {
+        struct jstream_column_s *k = c->columns + i;
+        // COLUMN_STR has an offset more
+        size_t n = (cap + (k->type == COLUMN_STR)) * jstream_col_width(k);
+        void *data = jstream_col_realloc(c, k->data, n);
+        if (data == NULL) return 0;
+        if (k->data == NULL && k->type == COLUMN_STR) *(uint64_t*) data = 0;
+        k->data = data;
+        uint8_t *valid = jstream_col_realloc(c, k->valid, (cap + 7) / 8);
+        if (valid == NULL) return 0;
+        k->valid = valid;
+    }
+    c->capacity = cap;
+    return 1;
+}
+
+/** Start the row of a record, without any value: return nonzero
+    if there is no memory. */
+static int jstream_col_row(jstream_columns_t c)
+{
+    size_t r = c->rows;
+    if (r == c->capacity) {
+        size_t cap = c->capacity == 0 ? JSTREAM_ROWS : 2 * c->capacity;
+        if (cap <= r || !jstream_col_grow(c, cap)) {
+            c->error = ERR_MEMORY;
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < c->n; ++ i) {
+        struct jstream_column_s *k = c->columns + i;
+        k->valid[r / 8] &= (uint8_t) ~(1u << r % 8);
+        switch (k->type) {
+            case COLUMN_F64:
+                ((double*) k->data)[r] = 0;
+                break;
+            case COLUMN_I64:
+                ((int64_t*) k->data)[r] = 0;
+                break;
+            case COLUMN_BOOL:
+                ((uint8_t*) k->data)[r] = 0;
+                break;
+            case COLUMN_STR: {
+                // drop the characters of a record not parsed in full
+                uint64_t *offsets = k->data;
+                k->chars_size = offsets[r];
+                offsets[r + 1] = offsets[r];
+                break;
+            }
+        }
+    }
+    c->filled = 0;
+    return 0;
+}
+
+/** Level of the records (1 for the elements of an array). */
+static unsigned jstream_col_level(jstream_columns_t c)
+{
+    return c->array ? 2 : 1;
+}
+
+/** Return the columns of the current member which take a
+    scalar value, that is whose paths end with its key, and
+    which have no value yet. */
+static uint64_t jstream_col_scalar(jstream_columns_t c)
+{
+    uint64_t m = c->key & ~c->filled;
+    unsigned level = jstream_col_level(c);
+    c->key = 0;
+    if (m == 0 || c->depth < level) return 0;
+    unsigned t = c->depth - level + 1;
+    for (unsigned i = 0; i < c->n; ++ i)
+        if (c->tokens[i] != t) m &= ~((uint64_t) 1 << i);
+    c->filled |= m;
+    return m;
+}
+
+/* *** HANDLERS *** */
+
+static int jstream_col_null(void *ctx)
+{
+    jstream_col_scalar(ctx);
+    return 0;
+}
+
+static int jstream_col_boolean(void *ctx, int b)
+{
+    jstream_columns_t c = ctx;
+    uint64_t m = jstream_col_scalar(c);
+    for (unsigned i = 0; m != 0; ++ i, m >>= 1) {
+        struct jstream_column_s *k = c->columns + i;
+        if (!(m & 1) || k->type != COLUMN_BOOL) continue;
+        ((uint8_t*) k->data)[c->rows] = (uint8_t) b;
+        k->valid[c->rows / 8] |= (uint8_t) (1u << c->rows % 8);
+    }
+    return 0;
+}
+
+/** Store a number into the columns of the current member: i is
+    its value if integral is not 0. */
+static void jstream_col_number(jstream_columns_t c, double d, int integral, int64_t i)
+{
+    uint64_t m = jstream_col_scalar(c);
+    for (unsigned j = 0; m != 0; ++ j, m >>= 1) {
+        struct jstream_column_s *k = c->columns + j;
+        if (!(m & 1)) continue;
+        if (k->type == COLUMN_F64) ((double*) k->data)[c->rows] = d;
+        else if (k->type == COLUMN_I64 && integral) ((int64_t*) k->data)[c->rows] = i;
+        else continue;
+        k->valid[c->rows / 8] |= (uint8_t) (1u << c->rows % 8);
+    }
+}
+
+static int jstream_col_double(void *ctx, double d)
+{
+    // integers too large for int64_t are parsed as doubles
+    int integral = d >= -9223372036854775808.0 && d < 9223372036854775808.0
+        && (double) (int64_t) d == d;
+    jstream_col_number(ctx, d, integral, integral ? (int64_t) d : 0);
+    return 0;
+}
+
+static int jstream_col_integer(void *ctx, int64_t i)
+{
+    jstream_col_number(ctx, (double) i, 1, i);
+    return 0;
+}
+
+static int jstream_col_string(void *ctx, const char *s, size_t n)
+{
+    jstream_columns_t c = ctx;
+    uint64_t m = jstream_col_scalar(c);
+    for (unsigned i = 0; m != 0; ++ i, m >>= 1) {
+        struct jstream_column_s *k = c->columns + i;
+        if (!(m & 1) || k->type != COLUMN_STR) continue;
+        if (n > k->chars_capacity - k->chars_size) {
+            size_t cap = k->chars_capacity == 0 ? 4096 : k->chars_capacity;
+            while (cap - k->chars_size < n) {
+                if (cap > SIZE_MAX / 2) {
+                    c->error = ERR_MEMORY;
+                    return 1;
+                }
+                cap *= 2;
+            }
+            char *chars = jstream_col_realloc(c, k->chars, cap);
+            if (chars == NULL) {
+                c->error = ERR_MEMORY;
+                return 1;
+            }
+            k->chars = chars;
+            k->chars_capacity = cap;
+        }
+        if (n > 0) memcpy(k->chars + k->chars_size, s, n);
+        k->chars_size += n;
+        ((uint64_t*) k->data)[c->rows + 1] = k->chars_size;
+        k->valid[c->rows / 8] |= (uint8_t) (1u << c->rows % 8);
+    }
+    return 0;
+}
+
+static int jstream_col_member(void *ctx, const char *s, size_t n)
+{
+    jstream_columns_t c = ctx;
+    unsigned level = jstream_col_level(c);
+    c->key = 0;
+    if (c->depth < level || c->depth - level >= JSTREAM_DEPTH) return 0;
+    unsigned t = c->depth - level;
+    uint64_t live = c->live[c->depth - level];
+    for (unsigned i = 0; live != 0; ++ i, live >>= 1) {
+        size_t len;
+        if (!(live & 1)) continue;
+        const char *token = jstream_pointer_token(c->columns[i].path, t, &len);
+        if (token != NULL && ((len == 1 && *token == '*')
+                || jstream_pointer_key(token, len, s, n)))
+            c->key |= (uint64_t) 1 << i;
+    }
+    return 0;
+}
+
+/** Open an array or an object (as object says), which starts a
+    record if it is an object at the level of the records. */
+static int jstream_col_open(jstream_columns_t c, int object)
+{
+    unsigned level = jstream_col_level(c);
+    uint64_t key = c->key;
+    c->key = 0;
+    ++ c->depth;
+    if (c->depth < level) {
+        c->outer = !object;    // the array of the records
+        return 0;
+    }
+    if (c->depth - level >= JSTREAM_DEPTH) return 0;
+    if (c->depth == level) {
+        c->record = object && (!c->array || c->outer);
+        if (!c->record) return 0;
+        c->live[0] = c->n == 0 ? 0 : ~(uint64_t) 0 >> (64 - c->n);
+        return jstream_col_row(c);
+    }
+    c->live[c->depth - level] = object ? key & ~c->filled : 0;
+    return 0;
+}
+
+/** Close an array or an object, which ends a record if it is
+    its object. */
+static int jstream_col_close(jstream_columns_t c)
+{
+    unsigned level = jstream_col_level(c);
+    c->key = 0;
+    if (c->depth == level && c->record) {
+        c->record = 0;
+        ++ c->rows;
+    }
+    if (c->depth < level) c->outer = 0;
+    -- c->depth;
+    return 0;
+}
+
+static int jstream_col_begin_array(void *ctx)
+{
+    return jstream_col_open(ctx, 0);
+}
+
+static int jstream_col_end_array(void *ctx, unsigned n)
+{
+    (void) n;
+    return jstream_col_close(ctx);
+}
+
+static int jstream_col_begin_object(void *ctx)
+{
+    return jstream_col_open(ctx, 1);
+}
+
+static int jstream_col_end_object(void *ctx, unsigned n)
+{
+    (void) n;
+    return jstream_col_close(ctx);
+}
+
+static const struct jstream_handler_s jstream_col_handler = {
+    jstream_col_null,
+    jstream_col_boolean,
+    jstream_col_double,
+    jstream_col_integer,
+    jstream_col_string,
+    jstream_col_member,
+    jstream_col_begin_array,
+    jstream_col_end_array,
+    jstream_col_begin_object,
+    jstream_col_end_object
+};
+
+/** Parse the values of p into the columns of c, from the text of
+    n characters starting at s, or from the input of p if s is
+    NULL. */
+static int jstream_col_parse(jstream_columns_t c, jstream_param_t p,
+    const char *s, size_t n)
+{
+    c->error = ERR_NONE;
+    if (c->n > 63) return c->error = ERR_KEY;
+    size_t len = 0;
+    for (unsigned i = 0; i < c->n; ++ i) {
+        const char *path = c->columns[i].path;
+        unsigned t = 0;
+        for (const char *q = path; *q != '\0'; ++ q) t += *q == '/';
+        if (path[0] != '/' || t > JSTREAM_DEPTH - 2)
+            return c->error = ERR_KEY;
+        c->tokens[i] = (unsigned char) t;
+        len += strlen(path) + 3;
+    }
+    // the paths of the filter, starting with "/*" in array mode
+    const char **paths = jstream_col_realloc(c, NULL,
+        (c->n + 1) * sizeof(char*) + len);
+    if (paths == NULL) return c->error = ERR_MEMORY;
+    char *t = (char*) (paths + c->n + 1);
+    for (unsigned i = 0; i < c->n; ++ i) {
+        paths[i] = t;
+        if (c->array) t += strlen(strcpy(t, "/*"));
+        t += strlen(strcpy(t, c->columns[i].path)) + 1;
+    }
+    paths[c->n] = NULL;
+    const struct jstream_handler_s *handler = p->handler;
+    void *handler_ctx = p->handler_ctx;
+    const char *const *filter = p->paths;
+    int integers = p->integers;
+    p->handler = &jstream_col_handler;
+    p->handler_ctx = c;
+    p->paths = paths;
+    p->integers = 1;
+    c->depth = 0;
+    c->outer = 0;
+    c->record = 0;
+    c->key = 0;
+    if (s != NULL) jstream_parse_buffer(p, s, n);
+    else jstream(p);
+    while (p->error == ERR_NONE) jstream_next_document(p);
+    p->handler = handler;
+    p->handler_ctx = handler_ctx;
+    p->paths = filter;
+    p->integers = integers;
+    jstream_col_release(c, paths);
+    if (c->error == ERR_NONE && p->error != ERR_END) c->error = p->error;
+    return c->error;
+}
+
+/* *** PUBLIC STUFF *** */
+
+int jstream_columns(jstream_columns_t c, jstream_param_t p)
+{
+    return jstream_col_parse(c, p, NULL, 0);
+}
+
+int jstream_columns_buffer(jstream_columns_t c, jstream_param_t p,
+    const char *s, size_t n)
+{
+    struct jstream_param_s q;
+    if (p == NULL) {
+        memset(&q, 0, sizeof(q));
+        p = &q;
+    }
+    int e = jstream_col_parse(c, p, s, n);
+    if (p == &q) jstream_free(&q);
+    return e;
+}
+
+void jstream_columns_free(jstream_columns_t c)
+{
+    for (unsigned i = 0; i < c->n; ++ i) {
+        struct jstream_column_s *k = c->columns + i;
+        jstream_col_release(c, k->data);
+        jstream_col_release(c, k->valid);
+        jstream_col_release(c, k->chars);
+        k->data = NULL;
+        k->valid = NULL;
+        k->chars = NULL;
+        k->chars_size = 0;
+        k->chars_capacity = 0;
+    }
+    c->rows = 0;
+    c->capacity = 0;
+}
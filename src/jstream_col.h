@@ -0,0 +1,105 @@
+/** \file jstream_col.h */
+
+#ifndef JSTREAM_COL_INC
+#define JSTREAM_COL_INC
+
+#include "jstream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Types of the values of a column. */
+enum {
+    COLUMN_F64,         ///< double (from any number)
+    COLUMN_I64,         ///< int64_t (from integral numbers)
+    COLUMN_BOOL,        ///< uint8_t, 0 or 1 (from true and false)
+    COLUMN_STR          ///< offsets of the characters (from strings)
+};
+
+/** A column filled by jstream_columns: path and type are given
+    by the caller, the other fields are filled, one row per
+    record. Row i has a value if bit i % 8 of valid[i / 8] is 1
+    (as in Apache Arrow), else it is 0 (or an empty string): the
+    values are double, int64_t or uint8_t items of data, as type
+    says, while for COLUMN_STR data points to rows + 1 uint64_t
+    offsets, so that the string of row i is made of the
+    characters of chars from offset i to offset i + 1 (which
+    are not '\0'-terminated). */
+struct jstream_column_s {
+    const char *path;   ///< JSON Pointer of the value in a record
+    int type;           ///< COLUMN_F64, COLUMN_I64, COLUMN_BOOL or COLUMN_STR
+    void *data;         ///< values, or offsets in chars
+    uint8_t *valid;     ///< bitmap of the rows having a value
+    char *chars;        ///< characters of the strings of a COLUMN_STR
+    size_t chars_size;  ///< number of characters in chars
+    size_t chars_capacity;  ///< number of characters allocated in chars
+};
+
+/** Structure used to pass and receive parameters to and from
+    jstream_columns: its fields should be zero, but for the ones
+    that are used. */
+typedef struct jstream_columns_s {
+// public
+    int error;          ///< error code (0 means no error)
+    struct jstream_column_s *columns;   ///< the columns to fill
+    unsigned n;         ///< number of columns (at most 63)
+    int array;          ///< if != 0 records are the elements of an array
+    size_t rows;        ///< number of rows filled
+// allocation policy (zero fields mean malloc/realloc/free)
+    void *(*mem_alloc)(void *user, size_t size);    ///< allocate a block
+    void *(*mem_realloc)(void *user, void *ptr, size_t size);  ///< resize a block
+    void (*mem_free)(void *user, void *ptr);        ///< release a block
+    void *mem_user;     ///< user pointer passed to the hooks
+// private
+    size_t capacity;    ///< number of rows allocated in the columns
+    unsigned depth;     ///< number of open arrays and objects
+    int outer;          ///< nonzero if the outer array is open (array mode)
+    int record;         ///< nonzero if a record is open
+    uint64_t filled;    ///< columns having a value in the current row
+    uint64_t key;       ///< columns of the current member
+    unsigned char tokens[63];   ///< number of tokens of each path
+    uint64_t live[JSTREAM_DEPTH];   ///< columns inside each open object
+} *jstream_columns_t;
+
+/** Parse the Json values read by means of p (as jstream does,
+    followed by jstream_next_document until the input is over),
+    each of which is a record, or if c->array is not 0 an array
+    whose elements are records, and append a row per record to
+    the c->n columns in c->columns, filling each one with the
+    value that its path (a JSON Pointer, whose tokens are keys
+    or "*", matching any key) points to in the record, if it has
+    the type of the column, else leaving it without a value.
+    Records which are not objects are skipped. Numbers are
+    converted to double for a COLUMN_F64, and only integral
+    ones fill a COLUMN_I64; if the path matches more members,
+    the first one counts. The values are passed to the column
+    by the event mode of jstream, with p->paths set to the paths
+    of the columns, so that anything else in the records is
+    skipped without storing nor converting it, and no tree is
+    built: p->handler, p->handler_ctx, p->paths and p->integers
+    are restored before returning, while the other options of
+    *p apply. More calls append more rows, until the columns are
+    released by jstream_columns_free.
+    Return c->error, that is either ERR_NONE, or the error code
+    of the parsing (whose offset is in p->offset), or ERR_KEY if
+    there are more than 63 columns, or a path is empty or has
+    more than JSTREAM_DEPTH - 2 tokens, or ERR_MEMORY. In case
+    of error the rows of the records parsed in full are kept. */
+extern int jstream_columns(jstream_columns_t c, jstream_param_t p);
+
+/** Same as jstream_columns, but parse the text of n characters
+    starting at s (as jstream_parse_buffer does): if p is NULL,
+    the default options are used. */
+extern int jstream_columns_buffer(jstream_columns_t c, jstream_param_t p,
+    const char *s, size_t n);
+
+/** Release the buffers of the columns of c, by the allocation
+    hooks of c, and reset them and c->rows. */
+extern void jstream_columns_free(jstream_columns_t c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
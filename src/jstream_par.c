@@ -0,0 +1,614 @@
+/** \file jstream_par.c */
+
+/** \section json_parallel Parallel parsing
+
+    The text is split into chunks which end at newlines: chunk
+    k starts after the first newline found from k * chunk on
+    (or at 0 if k == 0), so that each thread can compute the
+    bounds of the chunks it parses without any coordination.
+    Threads take the number of the next chunk to parse from an
+    atomic counter, and at most JSTREAM_WINDOW chunks per thread
+    may be parsed and not yet consumed, which bounds the memory used.
+
+    A parsed chunk is a memory block containing its records one
+    after the other (they are scanned by jstream_skip), plus the
+    offsets of the records in the text. In ordered mode chunk k
+    is stored into the slot (k % window) of a ring, that the
+    consumer scans in order; in unordered mode chunks are pushed
+    onto a lock-free stack, that the consumer empties at once.
+    Consumed chunks (with their memory block) are given back to
+    the thread that parsed them, by its own lock-free stack of
+    free chunks, so that in the long run no allocation occurs.
+
+    A text containing a single huge array is first scanned by the
+    calling thread, looking only at quotes, backslashes, brackets
+    and commas, to find the commas separating the elements of the
+    array at top level: every about q->chunk characters one of them
+    ends a chunk, and the chunks, each containing some elements
+    separated by commas, are parsed as above. This scan is much
+    faster than parsing, since it does not store anything, and
+    any error it does not detect (e.g. a bracket closed by a brace)
+    is detected by parsing the elements. The records of the chunks
+    are passed to q->record, or, without it, they are copied in
+    order, one chunk at a time, after the header of an ARRAY. */
+
+/* *** MODULE jstream_par *** */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jstream_par.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* *** PRIVATE STUFF *** */
+
+/** Default number of characters in a chunk. */
+#define JSTREAM_CHUNK (1 << 20)
+
+/** Maximum number of chunks per thread parsed and not consumed. */
+#define JSTREAM_WINDOW 4
+
+struct jstream_worker_s;
+
+/** A chunk of the text, and the records parsed from it. */
+struct jstream_chunk_s {
+    jstream_t obj;      ///< memory block containing the records
+    unsigned size;      ///< number of words used in obj
+    unsigned capacity;  ///< number of words allocated in obj
+    size_t records;     ///< number of records
+    size_t *offsets;    ///< offsets of the records in the text
+    size_t cap;         ///< number of items allocated in offsets
+    int error;          ///< error code of the record following them
+    size_t offset;      ///< offset of the record with the error
+    struct jstream_worker_s *owner;     ///< thread owning the chunk
+    struct jstream_chunk_s *next;       ///< next chunk in a stack
+};
+
+/** Data shared by all threads. */
+struct jstream_job_s {
+    jstream_parallel_t q;       ///< parameters
+    const char *s;              ///< text
+    size_t n;                   ///< length of the text
+    size_t chunk;               ///< characters in a chunk
+    size_t chunks;              ///< number of chunks
+    size_t *bounds;             ///< array mode: separators of the chunks
+    jstream_t out;              ///< array mode: the array under construction
+    size_t size;                ///< number of words used in out
+    size_t capacity;            ///< number of words allocated in out
+    size_t window;              ///< chunks parsed and not consumed
+    int ordered;                ///< nonzero to consume chunks in order
+    atomic_size_t next;         ///< next chunk to parse
+    atomic_size_t consumed;     ///< number of consumed chunks
+    atomic_int stop;            ///< nonzero if threads should stop
+    _Atomic(struct jstream_chunk_s*) *ring;     ///< ordered mode: ready chunks
+    _Atomic(struct jstream_chunk_s*) ready;     ///< unordered mode: ready chunks
+};
+
+/** Data of each thread. */
+struct jstream_worker_s {
+    pthread_t thread;
+    struct jstream_job_s *job;
+    struct jstream_param_s p;   ///< parser used by the thread
+    _Atomic(struct jstream_chunk_s*) free;  ///< chunks given back
+    struct jstream_chunk_s *pool;           ///< chunks ready to be used
+    int started;                ///< nonzero if thread is running
+};
+
+/** Push c onto the lock-free stack *top. */
+static void jstream_push(_Atomic(struct jstream_chunk_s*) *top,
+    struct jstream_chunk_s *c)
+{
+    c->next = atomic_load_explicit(top, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(top, &c->next, c,
+        memory_order_release, memory_order_relaxed))
+        ;
+}
+
+/** Pop all of the lock-free stack *top at once. */
+static struct jstream_chunk_s *jstream_pop_all(_Atomic(struct jstream_chunk_s*) *top)
+{
+    return atomic_exchange_explicit(top, NULL, memory_order_acquire);
+}
+
+/** Resize the block ptr to size bytes (allocate it if ptr is
+    NULL) by the allocation hooks of the job. */
+static void *jstream_par_realloc(struct jstream_job_s *job, void *ptr, size_t size)
+{
+    const struct jstream_param_s *t = job->q->param;
+    if (ptr == NULL)
+        return t == NULL || t->mem_alloc == NULL ? malloc(size)
+            : t->mem_alloc(t->mem_user, size);
+    return t == NULL || t->mem_realloc == NULL ? realloc(ptr, size)
+        : t->mem_realloc(t->mem_user, ptr, size);
+}
+
+/** Release memory by the allocation hooks of the job. */
+static void jstream_release(struct jstream_job_s *job, void *ptr)
+{
+    const struct jstream_param_s *t = job->q->param;
+    if (ptr == NULL) return;
+    if (t == NULL || t->mem_free == NULL) free(ptr);
+    else t->mem_free(t->mem_user, ptr);
+}
+
+/** Free the chunks in the list c. */
+static void jstream_free_chunks(struct jstream_job_s *job, struct jstream_chunk_s *c)
+{
+    while (c != NULL) {
+        struct jstream_chunk_s *next = c->next;
+        jstream_release(job, c->obj);
+        free(c->offsets);
+        free(c);
+        c = next;
+    }
+}
+
+/** Return nonzero if c is a Json space. */
+static inline int jstream_par_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/** Classes of characters met by jstream_split. */
+enum { SPLIT_NONE, SPLIT_QUOTE, SPLIT_BACKSLASH, SPLIT_OPEN, SPLIT_CLOSE, SPLIT_COMMA };
+
+/** Class of each character for jstream_split. */
+static const unsigned char jstream_split_class[256] = {
+    ['"'] = SPLIT_QUOTE, ['\\'] = SPLIT_BACKSLASH,
+    ['['] = SPLIT_OPEN, ['{'] = SPLIT_OPEN,
+    [']'] = SPLIT_CLOSE, ['}'] = SPLIT_CLOSE,
+    [','] = SPLIT_COMMA
+};
+
+/** Scan the array starting at offset i of the text, where there
+    is its '[', and store in job->bounds the offsets of each
+    separator of its chunks: the '[', one comma at top level every
+    about job->chunk characters and the closing ']'. Return the
+    error code, or ERR_NONE. */
+static int jstream_split(struct jstream_job_s *job, size_t i)
+{
+    const unsigned char *s = (const unsigned char*) job->s;
+    size_t n = job->n, cap = 64, depth = 0, last = i;
+    job->chunks = 0;
+    job->bounds = malloc(cap * sizeof(size_t));
+    if (job->bounds == NULL) return ERR_MEMORY;
+    job->bounds[0] = i;
+    for (;; ++ i) {
+        while (i < n && jstream_split_class[s[i]] == SPLIT_NONE)
+            ++ i;
+        if (i == n) {
+            job->q->offset = n;
+            return ERR_CLOSED_BRACKET;
+        }
+        switch (jstream_split_class[s[i]]) {
+        case SPLIT_QUOTE:
+            // skip the string, looking only for '"' and '\\'
+            for (++ i; i < n && s[i] != '"'; ++ i)
+                if (s[i] == '\\') ++ i;
+            if (i >= n) {
+                job->q->offset = n;
+                return ERR_EOS_INSIDE_STRING;
+            }
+            continue;
+        case SPLIT_BACKSLASH:
+            continue;   // outside strings it is an error found by parsing
+        case SPLIT_OPEN:
+            ++ depth;
+            continue;
+        case SPLIT_CLOSE:
+            if (-- depth > 0) continue;
+            break;
+        case SPLIT_COMMA:
+            if (depth > 1 || i - last < job->chunk) continue;
+            break;
+        }
+        if (job->chunks + 2 > cap) {
+            size_t *bounds = realloc(job->bounds, (cap *= 2) * sizeof(size_t));
+            if (bounds == NULL) return ERR_MEMORY;
+            job->bounds = bounds;
+        }
+        job->bounds[++ job->chunks] = last = i;
+        if (depth == 0) return ERR_NONE;
+    }
+}
+
+/** Append offset to the offsets of the records of c: return
+    0 if out of memory. */
+static int jstream_chunk_offset(struct jstream_chunk_s *c, size_t offset)
+{
+    if (c->records == c->cap) {
+        size_t cap = c->cap == 0 ? 256 : 2 * c->cap;
+        size_t *offsets = realloc(c->offsets, cap * sizeof(size_t));
+        if (offsets == NULL) return 0;
+        c->offsets = offsets;
+        c->cap = cap;
+    }
+    c->offsets[c->records ++] = offset;
+    return 1;
+}
+
+/** Return the offset of the chunk k in the text. */
+static size_t jstream_chunk_start(struct jstream_job_s *job, size_t k)
+{
+    if (job->bounds != NULL) return job->bounds[k] + 1;
+    if (k == 0) return 0;
+    if (k >= job->chunks) return job->n;
+    size_t i = k * job->chunk;
+    const char *nl = memchr(job->s + i, '\n', job->n - i);
+    return nl == NULL ? job->n : (size_t) (nl + 1 - job->s);
+}
+
+/** Parse the records in the chunk [i, j) of the text into c. */
+static void jstream_parse_chunk(struct jstream_worker_s *w,
+    struct jstream_chunk_s *c, size_t i, size_t j)
+{
+    jstream_param_t p = &w->p;
+    const char *s = w->job->s;
+    c->records = 0;
+    c->error = ERR_NONE;
+    p->obj = c->obj;
+    p->capacity = c->capacity;
+    p->size = 0;
+    // skip spaces, so that the offset of the first record is exact
+    while (i < j && jstream_par_space(s[i]))
+        ++ i;
+    if (w->job->bounds != NULL) {
+        // elements separated by commas: only "[]" has no element
+        int empty = i == j && w->job->chunks == 1;
+        if (!empty) for (;;) {
+            if (jstream_parse_buffer(p, s + i, j - i) == NULL) break;
+            if (!jstream_chunk_offset(c, i)) {
+                p->error = ERR_MEMORY;
+                break;
+            }
+            for (i += p->offset; i < j && jstream_par_space(s[i]); ++ i)
+                ;
+            if (i == j) {
+                p->error = ERR_END;
+                break;
+            }
+            if (s[i] != ',') {
+                p->error = ERR_COMMA;
+                break;
+            }
+            for (++ i; i < j && jstream_par_space(s[i]); ++ i)
+                ;
+        }
+        if (!empty && p->error != ERR_END) {
+            c->error = p->error;
+            c->offset = i;
+        }
+    } else if (i < j) {
+        size_t start = i;
+        jstream_t obj = jstream_parse_buffer(p, s + i, j - i);
+        while (obj != NULL) {
+            if (!jstream_chunk_offset(c, start)) {
+                p->error = ERR_MEMORY;
+                break;
+            }
+            for (start = i + p->offset; start < j && jstream_par_space(s[start]); ++ start)
+                ;
+            obj = jstream_next_document(p);
+        }
+        if (p->error != ERR_END) {
+            c->error = p->error;
+            c->offset = start;
+        }
+    }
+    // the block now belongs to the chunk
+    c->size = p->size;
+    c->obj = p->obj;
+    c->capacity = p->capacity;
+    p->obj = NULL;
+    p->capacity = 0;
+}
+
+/** Body of each parsing thread. */
+static void *jstream_worker(void *arg)
+{
+    struct jstream_worker_s *w = arg;
+    struct jstream_job_s *job = w->job;
+    for (;;) {
+        size_t k = atomic_fetch_add(&job->next, 1);
+        if (k >= job->chunks) break;
+        while (k >= atomic_load_explicit(&job->consumed, memory_order_acquire) + job->window
+        && !atomic_load(&job->stop))
+            sched_yield();
+        if (atomic_load(&job->stop)) break;
+        if (w->pool == NULL) w->pool = jstream_pop_all(&w->free);
+        struct jstream_chunk_s *c = w->pool;
+        if (c != NULL) {
+            w->pool = c->next;
+        } else if ((c = calloc(1, sizeof(*c))) == NULL) {
+            atomic_store(&job->stop, ERR_MEMORY);
+            break;
+        }
+        c->owner = w;
+        // in array mode the chunk ends at its separator
+        jstream_parse_chunk(w, c, jstream_chunk_start(job, k),
+            job->bounds != NULL ? job->bounds[k + 1] : jstream_chunk_start(job, k + 1));
+        if (job->ordered) {
+            c->next = NULL;
+            atomic_store_explicit(&job->ring[k % job->window], c, memory_order_release);
+        } else {
+            jstream_push(&job->ready, c);
+        }
+    }
+    return NULL;
+}
+
+/** Pass the records of c to the record function: return the
+    error code which stops the parsing, or ERR_NONE. */
+static int jstream_consume(struct jstream_job_s *job, struct jstream_chunk_s *c)
+{
+    jstream_parallel_t q = job->q;
+    jstream_t obj = c->obj;
+    if (q->record == NULL && job->bounds != NULL) {
+        // append the elements to the array, growing it if needed
+        if (job->size + c->size > job->capacity) {
+            size_t cap = 2 * job->capacity;
+            if (cap < job->size + c->size) cap = job->size + c->size;
+            jstream_t out = jstream_par_realloc(job, job->out, cap * sizeof(unsigned));
+            if (out == NULL) return ERR_MEMORY;
+            job->out = out;
+            job->capacity = cap;
+        }
+        if (c->size > 0)
+            memcpy(job->out + job->size, c->obj, c->size * sizeof(unsigned));
+        job->size += c->size;
+        q->records += c->records;
+        if (c->error != ERR_NONE) q->offset = c->offset;
+        return c->error;
+    }
+    for (size_t r = 0; r < c->records; ++ r) {
+        if (q->record != NULL && q->record(q->ctx, obj, c->offsets[r]) != 0) {
+            q->offset = c->offsets[r];
+            return ERR_HANDLER;
+        }
+        ++ q->records;
+        obj = jstream_skip(obj);
+    }
+    if (c->error != ERR_NONE) q->offset = c->offset;
+    return c->error;
+}
+
+/** Parse the chunks of job by q->threads threads, consuming
+    them in the calling thread: return q->error. */
+static int jstream_run(struct jstream_job_s *job)
+{
+    jstream_parallel_t q = job->q;
+    unsigned threads = q->threads == 0 ? 1 : q->threads;
+    job->window = JSTREAM_WINDOW * threads;
+    atomic_init(&job->next, 0);
+    atomic_init(&job->consumed, 0);
+    atomic_init(&job->stop, 0);
+    atomic_init(&job->ready, NULL);
+    job->ring = calloc(job->window, sizeof(*job->ring));
+    struct jstream_worker_s *w = calloc(threads, sizeof(*w));
+    if (job->ring == NULL || w == NULL) {
+        free(job->ring);
+        free(w);
+        return q->error = ERR_MEMORY;
+    }
+    for (unsigned t = 0; t < threads; ++ t) {
+        if (q->param != NULL) w[t].p = *q->param;
+        w[t].p.obj = NULL;
+        w[t].p.capacity = 0;
+        w[t].p.dict = NULL;     // each thread has its own dictionary
+        w[t].p.dict_size = w[t].p.dict_capacity = 0;
+        // nor the files or the buffer of jstream_feed of the caller
+        w[t].p.map = NULL;
+        w[t].p.map_size = 0;
+        w[t].p.image = NULL;
+        w[t].p.image_size = 0;
+        w[t].p.feed = NULL;
+        w[t].p.feed_size = w[t].p.feed_capacity = 0;
+        // gathered elements are moved, thus packed arrays lose alignment
+        if (q->record == NULL && job->bounds != NULL) w[t].p.packed = 0;
+        w[t].p.handler = NULL;
+        w[t].p.stats = NULL;    // it would be shared by the threads
+        w[t].p.reuse = 0;
+        w[t].p.append = 1;
+        w[t].job = job;
+        atomic_init(&w[t].free, NULL);
+        w[t].started = pthread_create(&w[t].thread, NULL, jstream_worker, w + t) == 0;
+        if (!w[t].started) atomic_store(&job->stop, ERR_MEMORY);
+    }
+    // Consume the chunks in the calling thread
+    for (size_t consumed = 0; consumed < job->chunks && q->error == ERR_NONE; ) {
+        if (atomic_load(&job->stop)) {
+            q->error = atomic_load(&job->stop);
+            break;
+        }
+        struct jstream_chunk_s *c;
+        if (job->ordered) {
+            c = atomic_exchange_explicit(&job->ring[consumed % job->window], NULL,
+                memory_order_acquire);
+        } else {
+            c = jstream_pop_all(&job->ready);
+        }
+        if (c == NULL) {
+            sched_yield();
+            continue;
+        }
+        while (c != NULL) {
+            struct jstream_chunk_s *next = c->next;
+            if (q->error == ERR_NONE) q->error = jstream_consume(job, c);
+            jstream_push(&c->owner->free, c);
+            atomic_store_explicit(&job->consumed, ++ consumed, memory_order_release);
+            c = next;
+        }
+    }
+    atomic_store(&job->stop, ERR_HANDLER);
+    for (unsigned t = 0; t < threads; ++ t)
+        if (w[t].started) pthread_join(w[t].thread, NULL);
+    // Free chunks ready and not consumed, then chunks of threads
+    for (size_t k = 0; k < job->window; ++ k)
+        jstream_free_chunks(job, atomic_load(&job->ring[k]));
+    jstream_free_chunks(job, atomic_load(&job->ready));
+    for (unsigned t = 0; t < threads; ++ t) {
+        jstream_free_chunks(job, w[t].pool);
+        jstream_free_chunks(job, atomic_load(&w[t].free));
+        jstream_free(&w[t].p);
+    }
+    free(job->ring);
+    free(w);
+    return q->error;
+}
+
+/** Initialize job to parse the n characters of s for q. */
+static void jstream_job(struct jstream_job_s *job, jstream_parallel_t q,
+    const char *s, size_t n)
+{
+    memset(job, 0, sizeof(*job));
+    job->q = q;
+    job->s = s;
+    job->n = n;
+    job->chunk = q->chunk == 0 ? JSTREAM_CHUNK : q->chunk;
+    job->ordered = q->ordered;
+    q->error = ERR_NONE;
+    q->offset = 0;
+    q->records = 0;
+}
+
+/** Map the file with the given name in memory, storing its
+    length into *n: return NULL if it can't be opened. */
+static const char *jstream_map(const char *name, size_t *n)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    *n = st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return "";
+    }
+    void *s = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) return NULL;
+    madvise(s, st.st_size, MADV_SEQUENTIAL);
+    return s;
+#else
+    // No mmap: the file is read in memory
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) return NULL;
+    size_t cap = 1 << 16;
+    char *s = malloc(cap);
+    *n = 0;
+    for (size_t m; s != NULL && (m = fread(s + *n, 1, cap - *n, f)) > 0; ) {
+        *n += m;
+        if (*n == cap) {
+            char *t = realloc(s, cap *= 2);
+            if (t == NULL) free(s);
+            s = t;
+        }
+    }
+    fclose(f);
+    return s;
+#endif
+}
+
+/** Release the text returned by jstream_map. */
+static void jstream_unmap(const char *s, size_t n)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    if (n > 0) munmap((void*) s, n);
+#else
+    free((void*) s);
+#endif
+}
+
+/* *** PUBLIC STUFF *** */
+
+int jstream_parallel(jstream_parallel_t q, const char *s, size_t n)
+{
+    struct jstream_job_s job;
+    jstream_job(&job, q, s, n);
+    job.chunks = n == 0 ? 0 : 1 + (n - 1) / job.chunk;
+    return jstream_run(&job);
+}
+
+int jstream_parallel_file(jstream_parallel_t q, const char *name)
+{
+    size_t n;
+    const char *s = jstream_map(name, &n);
+    if (s == NULL) return q->error = ERR_FILE;
+    int e = jstream_parallel(q, s, n);
+    jstream_unmap(s, n);
+    return e;
+}
+
+jstream_t jstream_parallel_array(jstream_parallel_t q, const char *s, size_t n)
+{
+    struct jstream_job_s job;
+    jstream_job(&job, q, s, n);
+    size_t i = 0;
+    while (i < n && jstream_par_space(s[i]))
+        ++ i;
+    if (i == n || s[i] != '[') {
+        q->offset = i;
+        q->error = ERR_VALUE;
+    } else {
+        q->error = jstream_split(&job, i);
+    }
+    if (q->error == ERR_NONE && q->record == NULL) {
+        // the array is stitched in order after its header
+        job.ordered = 1;
+        job.capacity = JSTREAM_CHUNK / sizeof(unsigned);
+        job.out = jstream_par_realloc(&job, NULL, job.capacity * sizeof(unsigned));
+        if (job.out == NULL) q->error = ERR_MEMORY;
+        job.size = 3;
+    }
+    if (q->error == ERR_NONE && jstream_run(&job) == ERR_NONE
+    && job.size > (unsigned) -1) q->error = ERR_MEMORY;
+    free(job.bounds);
+    if (q->error != ERR_NONE || job.out == NULL) {
+        jstream_release(&job, job.out);
+        return NULL;
+    }
+    job.out[0] = ARRAY;
+    job.out[1] = q->records;
+    job.out[2] = job.size;
+    return job.out;
+}
+
+jstream_t jstream_parallel_array_file(jstream_parallel_t q, const char *name)
+{
+    size_t n;
+    const char *s = jstream_map(name, &n);
+    if (s == NULL) {
+        q->error = ERR_FILE;
+        return NULL;
+    }
+    // the elements can't refer to the text, which is unmapped
+    const struct jstream_param_s *param = q->param;
+    struct jstream_param_s *t = NULL;
+    if (param != NULL && param->refs && q->record == NULL) {
+        t = malloc(sizeof(*t));
+        if (t == NULL) {
+            jstream_unmap(s, n);
+            q->error = ERR_MEMORY;
+            return NULL;
+        }
+        *t = *param;
+        t->refs = 0;
+        q->param = t;
+    }
+    jstream_t obj = jstream_parallel_array(q, s, n);
+    q->param = param;
+    free(t);
+    jstream_unmap(s, n);
+    return obj;
+}
@@ -0,0 +1,90 @@
+/** \file jstream_par.h */
+
+#ifndef JSTREAM_PAR_INC
+#define JSTREAM_PAR_INC
+
+#include "jstream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Function called by jstream_parallel on each record: obj is
+    the parsed record (which only lasts until the function
+    returns) and offset the offset of its first character in
+    the text. A nonzero return value stops the parsing. */
+typedef int (*jstream_record_t)(void *ctx, jstream_t obj, size_t offset);
+
+/** Structure used to pass and receive parameters to and from
+    jstream_parallel. */
+typedef struct jstream_parallel_s {
+// public
+    unsigned threads;   ///< number of parsing threads (0 means 1)
+    int ordered;        ///< if != 0 pass records in the order of the text
+    size_t chunk;       ///< bytes parsed by a thread at a time (0 = default)
+    jstream_record_t record;    ///< function called on each record
+    void *ctx;          ///< context passed to record
+    const struct jstream_param_s *param;    ///< options used to parse (or NULL)
+    int error;          ///< error code (0 means no error)
+    size_t offset;      ///< offset of the record where the error occurred
+    size_t records;     ///< number of records passed to record
+} *jstream_parallel_t;
+
+/** Parse the text of n characters starting at s, which contains
+    Json values separated by newlines (NDJSON), by means of
+    q->threads threads, each with its own struct jstream_param_s:
+    the text is split into chunks of about q->chunk characters
+    at newlines, each thread parses a chunk at a time into its
+    own memory block, and the records of each parsed chunk are
+    passed to q->record by the calling thread, in the order of
+    the text if q->ordered is not 0, else as soon as the chunk
+    is ready. Chunks are handed from the threads to the caller
+    by lock-free queues. If q->param is not NULL, the options
+    and allocation hooks it contains are used by each thread
+    (the hooks must be thread-safe), but for the handler and the
+    statistics (stats), which are ignored.
+    Return q->error, that is either ERR_NONE, or the error code
+    of the first record which can't be parsed (the first in the
+    text in ordered mode, else the first met), whose offset is
+    then stored in q->offset, or ERR_HANDLER if q->record has
+    stopped the parsing (or ERR_MEMORY). */
+extern int jstream_parallel(jstream_parallel_t q, const char *s, size_t n);
+
+/** Same as jstream_parallel, but parse the content of the file
+    with the given name, mapped in memory: if the file can't be
+    opened or mapped, ERR_FILE is returned. */
+extern int jstream_parallel_file(jstream_parallel_t q, const char *name);
+
+/** Parse the text of n characters starting at s, which contains
+    a single Json array, typically a huge one, by q->threads
+    threads: the text is first scanned to find the commas which
+    separate its elements at top level, tracking strings and
+    escapes but nothing else, so that the elements are split
+    into chunks of about q->chunk characters, which are then
+    parsed as in jstream_parallel. If q->record is not NULL, it
+    is passed each element with its offset (as q->ordered
+    says), and NULL is returned; else the elements are gathered
+    in order and the address of the resulting ARRAY is returned,
+    allocated by the hooks of q->param (or malloc), by which it
+    is to be released. In both cases q->records is the number of
+    elements and, in case of error, NULL is returned and q->error
+    and q->offset are set as in jstream_parallel (the error is
+    ERR_VALUE if the text does not start with '[', ERR_CLOSED_BRACKET
+    or ERR_EOS_INSIDE_STRING if the array is not closed). The
+    packed option of q->param is ignored if the elements are
+    gathered, since moving them would break the alignment of
+    packed arrays. */
+extern jstream_t jstream_parallel_array(jstream_parallel_t q, const char *s, size_t n);
+
+/** Same as jstream_parallel_array, but parse the content of the
+    file with the given name, mapped in memory: if the file can't
+    be opened or mapped, q->error is ERR_FILE. Since the file is
+    unmapped before returning, the refs option of q->param is
+    ignored if the elements are gathered into an array. */
+extern jstream_t jstream_parallel_array_file(jstream_parallel_t q, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+/** \file stats_paths.c */
+
+/** Check that the statistics of a parse with paths count only the
+    values that the filter keeps: compile it with JSTREAM_STATS
+    defined, e.g. by
+
+        clang -DJSTREAM_STATS -I../src stats_paths.c ../src/jstream.c -o stats_paths
+
+    and run it with no arguments: it prints "ok" and exits with 0,
+    or prints the counters which differ and exits with 1. */
+
+#include <stdio.h>
+#include <string.h>
+#include "jstream.h"
+
+int main(void)
+{
+    static const char text[] = "[[1],2,3,4,5,6]";
+    static const char *const paths[] = {"/0", NULL};
+    struct jstream_stats_s stats = {0};
+    struct jstream_param_s p = {0};
+    p.stats = &stats;
+    p.paths = paths;
+    p.reuse = 1;
+    // the second parse reuses the block, which holds stale words
+    for (int k = 0; k < 2; ++ k) {
+        if (jstream_parse_buffer(&p, text, strlen(text)) == NULL) {
+            printf("Error #%i\n", p.error);
+            return 1;
+        }
+    }
+    int bad = 0;
+    // [[1]] is kept: two arrays and a number per parse
+    for (int c = 0; c < 12; ++ c) {
+        size_t expected = c == ARRAY ? 4 : c == NUMBER ? 2 : 0;
+        if (stats.values[c] != expected) {
+            printf("values[%i] = %zu instead of %zu\n", c, stats.values[c], expected);
+            bad = 1;
+        }
+    }
+    jstream_free(&p);
+    if (!bad) puts("ok");
+    return bad;
+}